@@ -13,6 +13,11 @@
 #include <linux/mutex.h>
 #include <linux/completion.h>
 #include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/control.h>
@@ -27,10 +32,42 @@
 #define SL3_BYTES_PER_FRAME	18	/* 6 * 3 */
 #define SL3_MAX_PACKET_SIZE	126	/* 7 * 18 */
 
-/* URB configuration */
+/* High-speed isochronous: one packet per 125 us microframe */
+#define SL3_MICROFRAMES_PER_SEC	8000
+#define SL3_UFRAME_NS		(NSEC_PER_SEC / SL3_MICROFRAMES_PER_SEC)
+#define SL3_UFRAME_MASK		0x7ff	/* HCD frame counters wrap at >= 2048 */
+
+/* URB configuration (defaults, tunable per device) */
 #define SL3_NUM_URBS		16
 #define SL3_ISO_PACKETS		8	/* packets per URB */
-#define SL3_URB_MAX_RETRIES	3	/* max consecutive errors before xrun */
+#define SL3_MIN_URBS		2
+#define SL3_MAX_URBS		64
+#define SL3_MIN_ISO_PACKETS	1
+#define SL3_MAX_ISO_PACKETS	64
+#define SL3_URB_MAX_RETRIES	3	/* consecutive errors before recovery */
+#define SL3_URB_RECOVER_MS	10	/* delay before resubmitting dead URBs */
+#define SL3_WATCHDOG_MIN_MS	5	/* shortest stall the watchdog acts on */
+#define SL3_URB_CANCEL_MS	1000	/* wait for an unlinked queue to drain */
+#define SL3_MAX_KEEPALIVE	3600	/* longest idle keepalive, seconds */
+#define SL3_START_LEAD_MS	8	/* queue time for a common start frame */
+#define SL3_START_AT_MAX_MS	100	/* furthest armed start, < half the wrap */
+#define SL3_MAX_LATENCY_US	100000	/* largest device latency setting */
+
+/* Stream reset requests (stream->reset_pending), run by recover_work */
+#define SL3_RESET_HALT		0	/* endpoint stalled (-EPIPE) */
+#define SL3_RESET_STALL		1	/* completions stopped arriving */
+
+/* Device clock estimator: minimum span before reporting, window length */
+#define SL3_RATE_MIN_NS		(1 * NSEC_PER_SEC)
+#define SL3_RATE_WINDOW_NS	(64 * NSEC_PER_SEC)
+#define SL3_RATE_PPM_LIMIT	100000	/* control range, +/- ppm */
+
+/* PCM buffer limits: deep buffers are vmalloc'd, zero-copy is one block */
+#define SL3_BUFFER_BYTES_MAX	(16 * 1024 * 1024)	/* ~19 s at 48 kHz */
+#define SL3_ZEROCOPY_BYTES_MAX	(256 * 1024)
+
+/* Capture packet sizes buffered for playback (power of two) */
+#define SL3_FEEDBACK_FIFO_SIZE	1024
 
 /* USB interface numbers */
 #define SL3_INTF_AUDIO_CTRL	0
@@ -77,21 +114,161 @@ struct sl3_hid_report {
 
 struct sl3_device;
 
+/* What a stream does when the application falls behind */
+enum sl3_xrun_policy {
+	SL3_XRUN_STOP,		/* stop the PCM with an xrun */
+	SL3_XRUN_CONTINUE,	/* keep running: send silence / drop input */
+};
+
+/* How capture fills in for a bad packet to keep the timeline intact */
+enum sl3_conceal {
+	SL3_CONCEAL_OFF,	/* drop it: the ring slips against the device */
+	SL3_CONCEAL_SILENCE,	/* insert the expected frames as silence */
+	SL3_CONCEAL_REPEAT,	/* repeat the last good frame */
+};
+
+/*
+ * Stream continuity counters since probe, split by where a glitch
+ * comes from (under the stream lock).
+ */
+struct sl3_continuity {
+	u64	uframe_gaps;	/* URBs scheduled after skipped microframes */
+	u64	missed_uframes;	/* microframes skipped in those gaps */
+	u64	overlaps;	/* URBs scheduled before the last one ended */
+	u64	pkt_missed;	/* packets the host controller missed (-EXDEV) */
+	u64	pkt_errors;	/* packets with a bus error */
+	u64	short_pkts;	/* capture packets below the nominal size */
+	u64	empty_pkts;	/* zero-length capture packets */
+	u64	concealed_pkts;	/* bad capture packets filled in */
+	u64	concealed_frames;
+};
+
 struct sl3_urb_ctx {
 	struct urb		*urb;
 	u8			*buffer;
 	struct sl3_device	*dev;
 	int			index;
 	int			error_retries;	/* consecutive error count */
+	dma_addr_t		buffer_dma;	/* bus address of @buffer */
+	unsigned int		ring_frames;	/* zero-copy ring frames in flight */
+	struct list_head	ready_list;	/* idle low-latency playback URB */
+	unsigned int		frames;		/* frames in the sized packets */
+	bool			sized;		/* packets sized, not yet filled */
+	int			start_packet;	/* first ring data packet, or -1 */
 };
 
 struct sl3_stream {
 	struct snd_pcm_substream *substream;
-	struct sl3_urb_ctx	urbs[SL3_NUM_URBS];
-	unsigned int		hwptr;		/* hardware pointer in frames */
+	struct sl3_urb_ctx	*urbs;
+	unsigned int		num_urbs;
+	unsigned int		num_packets;	/* ISO packets per URB */
+	unsigned int		pipe;
+	u64			hwptr;		/* frames moved since prepare */
 	unsigned int		transfer_done;	/* frames since last period_elapsed */
-	bool			running;
+	bool			running;	/* URBs streaming */
+	bool			active;		/* PCM started: ring data moves */
+	bool			laid_out;	/* URBs sized for the next start */
 	spinlock_t		lock;
+	atomic_t		urbs_inflight;	/* URBs submitted, not completed */
+	struct usb_anchor	anchor;		/* URBs submitted, not given back */
+
+	/*
+	 * URBs retired after errors, resubmitted by recover_work.  While a
+	 * reset is pending nothing is submitted until recover_work has
+	 * killed the queue, cleared any halt and re-primed it.
+	 */
+	DECLARE_BITMAP(dead_urbs, SL3_MAX_URBS);
+	struct delayed_work	recover_work;
+	unsigned long		reset_pending;	/* SL3_RESET_* bits */
+	unsigned int		urbs_recovered;	/* since probe (under lock) */
+	unsigned int		halts_cleared;	/* since probe */
+
+	/* Completion watchdog: requests a reset when completions stop */
+	struct hrtimer		watchdog;
+	atomic_t		completions;	/* completion callbacks run */
+	unsigned int		wd_completions;	/* count at last progress */
+	ktime_t			wd_progress;	/* time of last progress */
+	u64			wd_timeout_ns;
+	ktime_t			stall_start;	/* last progress before a stall */
+
+	/* Stall recoveries since probe (under lock) */
+	unsigned int		stalls;
+	u64			stall_ns_last;	/* last progress to requeue */
+	u64			stall_ns_max;
+	unsigned int		coalesce;	/* interrupt on every Nth URB */
+
+	/* Low-latency playback: URBs wait here until the app writes data */
+	bool			lowlatency;
+	struct list_head	ready_list;
+	unsigned int		max_inflight;
+
+	/* Mirrored ring buffer: pages mapped twice, no split copies */
+	bool			mirror;		/* fixed at probe */
+	struct page		**mirror_pages;
+	unsigned int		mirror_npages;
+
+	/* Zero-copy playback: URBs transfer straight from the PCM buffer */
+	bool			zerocopy;
+	unsigned int		ring_inflight;	/* ring frames not yet sent */
+
+	/* Converter latency added to the reported delay, microseconds */
+	unsigned int		latency_us;
+
+	/* Application underrun/overrun handling (under lock) */
+	enum sl3_xrun_policy	xrun_policy;
+	bool			in_xrun;	/* counted, not yet recovered */
+	bool			xrun_pending;	/* stop once the lock is dropped */
+
+	/* Per-URB ring buffer copy cost, since stream start (under lock) */
+	u64			copy_ns;
+	u64			copy_max_ns;
+	u64			copy_urbs;
+
+	struct sl3_continuity	continuity;
+	unsigned int		conceal_acc;	/* 44.1 kHz fraction, concealment */
+
+	/* Delay estimate and link timestamps (under lock) */
+	ktime_t			last_complete;	/* time of the last completion */
+	unsigned int		ptr_step;	/* bus frames per completion batch */
+	u64			link_uframes;	/* bus microframes since start */
+	unsigned int		link_frame;	/* end microframe of last URB */
+	bool			link_valid;
+
+	/*
+	 * Explicit scheduling (under sched_lock): the first URB of a queue
+	 * goes out ASAP, and once the host controller has reported where,
+	 * every later URB is submitted on next_frame, straight after the
+	 * one before.  URBs the host
+	 * controller refuses that frame for go out ASAP; those and URBs it
+	 * moved to another frame anyway count as slips.
+	 * Every coalesce'th URB submitted raises the completion interrupt.
+	 */
+	spinlock_t		sched_lock;
+	bool			sched_valid;
+	unsigned int		next_frame;
+	unsigned int		submits;	/* since start or reset */
+	u64			slips;
+	u64			slip_uframes;	/* total they were moved by */
+
+	/*
+	 * Start of ring data (under lock).  Host controllers pick the
+	 * frame of a new queue themselves, so a start on a given
+	 * microframe is made on the running queue instead: until the
+	 * packet on start_frame (estimated CLOCK_MONOTONIC start_ns)
+	 * playback sends silence and capture drops what it receives.
+	 * With start_ns 0 ring data starts with the next URB.  first_frame
+	 * records the microframe the first ring data packet was actually
+	 * on, as the host controller reported it.
+	 */
+	unsigned int		start_frame;
+	s64			start_ns;
+	bool			start_pending;	/* no ring data moved yet */
+	unsigned int		first_frame;
+	bool			first_valid;
+
+	/* Start time armed through hwdep, used up by the next START */
+	s64			start_at_ns;	/* 0 = as soon as possible */
+	s64			start_req_ns;	/* armed time of the last start */
 };
 
 struct sl3_device {
@@ -108,9 +285,52 @@ struct sl3_device {
 	unsigned int		current_rate;	/* 44100 or 48000 */
 	u8			routing[3];	/* per-pair: 0x00=analog, 0x01=USB */
 
-	/* Implicit feedback tracking */
-	unsigned int		feedback_samples;
-	spinlock_t		feedback_lock;
+	/* Requested URB queue geometry, applied at the next stream prepare */
+	unsigned int		urb_count;
+	unsigned int		urb_packets;
+
+	/* Low-latency playback mode, applied at the next playback open */
+	bool			lowlatency;
+
+	/* Completion interrupt coalescing, applied at the next stream prepare */
+	bool			coalesce;
+
+	/*
+	 * Keepalive: endpoints stream silence while a PCM is open and for
+	 * this many seconds after the last close (0 = off), so trigger
+	 * START and STOP only switch the data source.
+	 */
+	unsigned int		keepalive;
+	struct delayed_work	keepalive_work;
+
+	/* Zero-copy playback from a DMA-coherent PCM buffer, fixed at probe */
+	bool			zerocopy;
+
+	/* Mirrored PCM ring buffers, fixed at probe */
+	bool			mirror;
+
+	/* Capture packet concealment, applied per URB */
+	enum sl3_conceal	conceal;
+
+	/*
+	 * Implicit feedback: frames per completed capture packet, in bus
+	 * order.  Single producer (capture completion), single consumer
+	 * (playback sizing under playback.lock), so no lock is needed.
+	 */
+	DECLARE_KFIFO(feedback_fifo, u16, SL3_FEEDBACK_FIFO_SIZE);
+
+	/*
+	 * Device clock estimate from capture completions (under
+	 * capture.lock): frames and bus microframes counted since
+	 * rate_start, and the resulting offsets from the nominal rate.
+	 */
+	ktime_t			rate_start;
+	u64			rate_frames;
+	u64			rate_uframes;
+	int			rate_ppm;	/* vs CLOCK_MONOTONIC */
+	int			rate_bus_ppm;	/* vs USB bus clock */
+	bool			rate_started;
+	bool			rate_valid;
 
 	/* 44.1kHz fractional sample accumulator */
 	unsigned int		sample_accumulator;
@@ -120,6 +340,7 @@ struct sl3_device {
 	u8			*hid_in_buf;
 	dma_addr_t		hid_in_dma;
 	u8			*hid_out_buf;	/* kmalloc'd for DMA safety */
+	struct work_struct	hid_halt_work;	/* clears an IN endpoint stall */
 	struct completion	hid_response_complete;
 	u8			hid_response_buf[SL3_HID_REPORT_SIZE];
 	struct mutex		hid_mutex;
@@ -145,6 +366,19 @@ struct sl3_device {
 	struct mutex		stream_mutex;
 };
 
+/*
+ * Ring buffer offset of a 64-bit frame position.  Positions only wrap
+ * modulo the buffer, never at a counter width.
+ */
+static inline unsigned int sl3_ring_pos(u64 frames,
+					struct snd_pcm_runtime *runtime)
+{
+	u32 rem;
+
+	div_u64_rem(frames, runtime->buffer_size, &rem);
+	return rem;
+}
+
 /* sl3_hid.c */
 int sl3_hid_init(struct sl3_device *dev);
 void sl3_hid_cleanup(struct sl3_device *dev);
@@ -159,15 +393,47 @@ int sl3_pcm_init(struct sl3_device *dev);
 int sl3_set_sample_rate(struct sl3_device *dev, unsigned int rate);
 
 /* sl3_urb.c */
+void sl3_urb_init(struct sl3_device *dev);
 int sl3_urb_alloc(struct sl3_device *dev, struct sl3_stream *stream, int pipe);
 void sl3_urb_free(struct sl3_device *dev, struct sl3_stream *stream);
-int sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream);
+void sl3_urb_drain(struct sl3_device *dev, struct sl3_stream *stream);
+void sl3_urb_stop_async(struct sl3_device *dev, struct sl3_stream *stream);
+bool sl3_urb_keepalive(struct sl3_device *dev, struct sl3_stream *stream);
+void sl3_urb_keepalive_idle(struct sl3_device *dev);
+int sl3_urb_prepare(struct sl3_device *dev, struct sl3_stream *stream);
+int sl3_urb_playback_ack(struct sl3_device *dev);
+snd_pcm_uframes_t sl3_urb_playback_overlap(struct sl3_stream *stream,
+					   struct snd_pcm_runtime *runtime);
+bool sl3_urb_rate_ppm(struct sl3_device *dev, int *ppm, int *bus_ppm);
+bool sl3_urb_frame_now(struct sl3_device *dev, unsigned int *uframe, s64 *ns);
+int sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream,
+		  struct sl3_stream *linked);
 void sl3_urb_stop(struct sl3_device *dev, struct sl3_stream *stream);
 
 /* sl3_control.c */
 int sl3_control_init(struct sl3_device *dev);
 
+/* sl3_hwdep.c */
+int sl3_hwdep_init(struct sl3_device *dev);
+
 /* sl3_proc.c */
 void sl3_proc_init(struct sl3_device *dev);
 
+/* sl3_sysfs.c */
+extern const struct attribute_group *sl3_attr_groups[];
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* Internals the KUnit checks (sl3_kunit.c) drive directly */
+snd_pcm_uframes_t sl3_stream_ahead(struct sl3_stream *stream,
+				   struct snd_pcm_runtime *runtime);
+snd_pcm_sframes_t sl3_playback_queued(struct sl3_stream *stream,
+				      struct snd_pcm_runtime *runtime);
+u64 sl3_pcm_position(struct sl3_stream *stream, bool is_playback);
+bool sl3_playback_underrun(struct sl3_device *dev,
+			   struct snd_pcm_substream *sub, unsigned int *frames);
+bool sl3_capture_overrun(struct sl3_device *dev,
+			 struct snd_pcm_substream *sub, unsigned int frames);
+void sl3_copy_playback_urb(struct sl3_device *dev, struct sl3_urb_ctx *ctx);
+#endif
+
 #endif /* SL3_H */
@@ -2,8 +2,8 @@
 /*
  * Rane SL3 USB Audio Interface - ALSA Mixer Controls
  *
- * Exposes sample rate, channel routing, and device status
- * as ALSA mixer controls.
+ * Exposes sample rate, channel routing, device status and the measured
+ * device clock rate as ALSA mixer controls.
  */
 
 #include <sound/core.h>
@@ -198,6 +198,42 @@ static const struct snd_kcontrol_new sl3_phono_ctl = {
 	.get	= sl3_phono_get,
 };
 
+/*
+ * Rate Ratio (read-only, volatile): measured device sample clock offset
+ * from the nominal rate against CLOCK_MONOTONIC, in ppm.  Reads 0 until
+ * capture has been running long enough to measure it.
+ */
+
+static int sl3_rate_ratio_info(struct snd_kcontrol *kctl,
+			       struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = -SL3_RATE_PPM_LIMIT;
+	uinfo->value.integer.max = SL3_RATE_PPM_LIMIT;
+	return 0;
+}
+
+static int sl3_rate_ratio_get(struct snd_kcontrol *kctl,
+			      struct snd_ctl_elem_value *uval)
+{
+	struct sl3_device *dev = snd_kcontrol_chip(kctl);
+	int ppm, bus_ppm;
+
+	sl3_urb_rate_ppm(dev, &ppm, &bus_ppm);
+	uval->value.integer.value[0] = ppm;
+	return 0;
+}
+
+static const struct snd_kcontrol_new sl3_rate_ratio_ctl = {
+	.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+	.name	= "Rate Ratio",
+	.access	= SNDRV_CTL_ELEM_ACCESS_READ |
+		  SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+	.info	= sl3_rate_ratio_info,
+	.get	= sl3_rate_ratio_get,
+};
+
 /* Create and register all ALSA mixer controls. */
 int sl3_control_init(struct sl3_device *dev)
 {
@@ -241,5 +277,13 @@ int sl3_control_init(struct sl3_device *dev)
 		return err;
 	dev->phono_ctl = kctl;
 
+	/* Rate Ratio */
+	kctl = snd_ctl_new1(&sl3_rate_ratio_ctl, dev);
+	if (!kctl)
+		return -ENOMEM;
+	err = snd_ctl_add(card, kctl);
+	if (err)
+		return err;
+
 	return 0;
 }
@@ -9,6 +9,7 @@
 #include <linux/usb.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/workqueue.h>
 
 #include "sl3.h"
 
@@ -57,10 +58,12 @@ static void sl3_hid_in_complete(struct urb *urb)
 				     "HID IN URB overflow\n");
 		goto resubmit;
 	case -EPIPE:
+		/* Clearing the halt sleeps; the worker resubmits after it */
 		dev_warn_ratelimited(&dev->intf->dev,
 				     "HID IN URB stall, clearing halt\n");
-		usb_clear_halt(dev->udev, urb->pipe);
-		goto resubmit;
+		if (!dev->disconnected)
+			schedule_work(&dev->hid_halt_work);
+		return;
 	default:
 		dev_warn_ratelimited(&dev->intf->dev,
 				     "HID IN URB error: %d\n", urb->status);
@@ -111,6 +114,29 @@ resubmit:
 	}
 }
 
+/* Clear a stalled HID IN endpoint and resubmit its URB */
+static void sl3_hid_halt_work(struct work_struct *work)
+{
+	struct sl3_device *dev = container_of(work, struct sl3_device,
+					      hid_halt_work);
+	struct urb *urb = dev->hid_in_urb;
+	int err;
+
+	if (dev->disconnected)
+		return;
+
+	err = usb_clear_halt(dev->udev, urb->pipe);
+	if (err)
+		dev_warn(&dev->intf->dev, "HID IN clear halt failed: %d\n",
+			 err);
+
+	/* -EPERM: poisoned by sl3_hid_cleanup() */
+	err = usb_submit_urb(urb, GFP_KERNEL);
+	if (err && err != -ENODEV && err != -EPERM)
+		dev_err(&dev->intf->dev,
+			"HID IN URB resubmit failed: %d\n", err);
+}
+
 /*
  * Send a HID command. Caller must hold hid_mutex.
  * If wait_response is true, blocks until a response arrives or timeout.
@@ -231,6 +257,8 @@ int sl3_hid_init(struct sl3_device *dev)
 	u8 payload[2];
 	int err;
 
+	INIT_WORK(&dev->hid_halt_work, sl3_hid_halt_work);
+
 	/* Allocate DMA-safe buffer for HID OUT (send) transfers */
 	dev->hid_out_buf = kmalloc(SL3_HID_REPORT_SIZE, GFP_KERNEL);
 	if (!dev->hid_out_buf)
@@ -329,7 +357,12 @@ err_free_out_buf:
 void sl3_hid_cleanup(struct sl3_device *dev)
 {
 	if (dev->hid_in_urb) {
-		usb_kill_urb(dev->hid_in_urb);
+		/*
+		 * Poison first: a stall completing before the URB is dead
+		 * still queues the halt worker, whose resubmit then fails.
+		 */
+		usb_poison_urb(dev->hid_in_urb);
+		cancel_work_sync(&dev->hid_halt_work);
 		usb_free_coherent(dev->udev, SL3_HID_REPORT_SIZE,
 				  dev->hid_in_buf, dev->hid_in_dma);
 		usb_free_urb(dev->hid_in_urb);
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-3.0
+/*
+ * Rane SL3 USB Audio Interface - ALSA Driver
+ *
+ * hwdep device for scheduled stream starts: arm a CLOCK_MONOTONIC start
+ * time that the next trigger START turns into the USB microframe ring
+ * data starts on, and read back where it actually started.  The ioctls
+ * are described in sl3_ioctl.h.
+ */
+
+#include <linux/uaccess.h>
+#include <sound/core.h>
+#include <sound/hwdep.h>
+
+#include "sl3.h"
+#include "sl3_ioctl.h"
+
+static struct sl3_stream *sl3_hwdep_stream(struct sl3_device *dev,
+					   __u32 stream)
+{
+	switch (stream) {
+	case SL3_STREAM_PLAYBACK:
+		return &dev->playback;
+	case SL3_STREAM_CAPTURE:
+		return &dev->capture;
+	default:
+		return NULL;
+	}
+}
+
+static int sl3_hwdep_frame_time(struct sl3_device *dev, void __user *arg)
+{
+	struct sl3_frame_time ft = {};
+	s64 ns;
+
+	if (!sl3_urb_frame_now(dev, &ft.uframe, &ns))
+		return -EIO;
+	ft.time_ns = ns;
+
+	return copy_to_user(arg, &ft, sizeof(ft)) ? -EFAULT : 0;
+}
+
+static int sl3_hwdep_start_at(struct sl3_device *dev, void __user *arg)
+{
+	struct sl3_start_at sa;
+	struct sl3_stream *stream;
+	unsigned long flags;
+	bool busy;
+
+	if (copy_from_user(&sa, arg, sizeof(sa)))
+		return -EFAULT;
+
+	stream = sl3_hwdep_stream(dev, sa.stream);
+	if (!stream || sa.time_ns < 0)
+		return -EINVAL;
+
+	/*
+	 * Only record the time: the START itself picks the microframe,
+	 * on a queue keepalive keeps streaming too.
+	 */
+	spin_lock_irqsave(&stream->lock, flags);
+	busy = stream->active;
+	if (!busy)
+		stream->start_at_ns = sa.time_ns;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	return busy ? -EBUSY : 0;
+}
+
+static int sl3_hwdep_start_info(struct sl3_device *dev, void __user *arg)
+{
+	struct sl3_start_info si;
+	struct sl3_stream *stream;
+	unsigned long flags;
+	int late;
+
+	if (copy_from_user(&si, arg, sizeof(si)))
+		return -EFAULT;
+
+	stream = sl3_hwdep_stream(dev, si.stream);
+	if (!stream)
+		return -EINVAL;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	si.flags = 0;
+	si.requested_uframe = stream->start_frame;
+	si.actual_uframe = stream->first_frame;
+	si.armed_ns = stream->start_req_ns;
+	si.requested_ns = stream->start_ns;
+	si.actual_ns = 0;
+	if (stream->first_valid) {
+		si.flags |= SL3_START_INFO_VALID;
+		/*
+		 * Microframes the start was off by, either way.
+		 * SL3_START_AT_MAX_MS keeps it inside half the counter wrap.
+		 */
+		late = (stream->first_frame - stream->start_frame) &
+		       SL3_UFRAME_MASK;
+		if (late > SL3_UFRAME_MASK / 2)
+			late -= SL3_UFRAME_MASK + 1;
+		if (stream->start_ns)
+			si.actual_ns = stream->start_ns +
+				       (s64)late * SL3_UFRAME_NS;
+	}
+	if (stream->start_req_ns)
+		si.flags |= SL3_START_INFO_ARMED;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	return copy_to_user(arg, &si, sizeof(si)) ? -EFAULT : 0;
+}
+
+static int sl3_hwdep_ioctl(struct snd_hwdep *hw, struct file *file,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct sl3_device *dev = hw->private_data;
+	void __user *argp = (void __user *)arg;
+
+	if (dev->disconnected)
+		return -ENODEV;
+
+	switch (cmd) {
+	case SL3_IOCTL_FRAME_TIME:
+		return sl3_hwdep_frame_time(dev, argp);
+	case SL3_IOCTL_START_AT:
+		return sl3_hwdep_start_at(dev, argp);
+	case SL3_IOCTL_START_INFO:
+		return sl3_hwdep_start_info(dev, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Create the hwdep device; it is registered and freed with the card. */
+int sl3_hwdep_init(struct sl3_device *dev)
+{
+	struct snd_hwdep *hw;
+	int err;
+
+	err = snd_hwdep_new(dev->card, "SL3 Timing", 0, &hw);
+	if (err < 0)
+		return err;
+
+	strscpy(hw->name, "SL3 Timing", sizeof(hw->name));
+	hw->private_data = dev;
+	/* The structures are laid out the same for 32-bit callers */
+	hw->ops.ioctl = sl3_hwdep_ioctl;
+	hw->ops.ioctl_compat = sl3_hwdep_ioctl;
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-3.0 WITH Linux-syscall-note */
+/*
+ * Rane SL3 USB Audio Interface - ALSA Driver
+ *
+ * Userspace interface of the "SL3 Timing" hwdep device
+ * (/dev/snd/hwC<card>D0): scheduled stream starts on a USB microframe.
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds.  Arm a start time, then
+ * trigger START (snd_pcm_start()) up to 100 ms before it.  The URB
+ * queue starts at once and streams silence (playback) or drops what it
+ * receives (capture) until the microframe nearest to the armed time;
+ * the stream's first audio packet is on that microframe.  Microframes
+ * are mapped to time to within half a millisecond, as USB only reports
+ * the 1 ms frame number.
+ */
+
+#ifndef SL3_IOCTL_H
+#define SL3_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SL3_STREAM_PLAYBACK	0
+#define SL3_STREAM_CAPTURE	1
+
+/* Current USB microframe (wraps) and its time */
+struct sl3_frame_time {
+	__u32	uframe;
+	__u32	reserved;
+	__s64	time_ns;
+};
+
+/* Start time for the next START of a stream; 0 disarms */
+struct sl3_start_at {
+	__u32	stream;		/* SL3_STREAM_* */
+	__u32	reserved;
+	__s64	time_ns;
+};
+
+#define SL3_START_INFO_VALID	(1 << 0)	/* first audio packet done */
+#define SL3_START_INFO_ARMED	(1 << 1)	/* started at an armed time */
+
+/*
+ * Where audio of the last start of a stream was to begin, and where it
+ * did.  The requested fields are 0 for a start with no armed time that
+ * was not linked to the other stream: its audio begins at once.
+ */
+struct sl3_start_info {
+	__u32	stream;		/* in: SL3_STREAM_* */
+	__u32	flags;		/* SL3_START_INFO_* */
+	__u32	requested_uframe;
+	__u32	actual_uframe;
+	__s64	armed_ns;	/* armed time, 0 if started at once */
+	__s64	requested_ns;	/* time of requested_uframe */
+	__s64	actual_ns;	/* time of actual_uframe */
+};
+
+#define SL3_IOCTL_FRAME_TIME	_IOR('S', 0x10, struct sl3_frame_time)
+#define SL3_IOCTL_START_AT	_IOW('S', 0x11, struct sl3_start_at)
+#define SL3_IOCTL_START_INFO	_IOWR('S', 0x12, struct sl3_start_info)
+
+#endif /* SL3_IOCTL_H */
@@ -0,0 +1,601 @@
+// SPDX-License-Identifier: GPL-3.0
+/*
+ * Rane SL3 USB Audio Interface - KUnit checks
+ *
+ * Time-compressed checks of the 64-bit stream position arithmetic: a
+ * position is seeded just short of 2^32 frames, where 32-bit counters
+ * used to wrap after about a day at 48 kHz, and advanced URB by URB
+ * past it.  The driver's own helpers run against a fake stream and PCM
+ * runtime, and the PCM core's pointer handling is modelled so its
+ * hw_ptr can be checked against the driver's.  Built only with
+ * "make SL3_KUNIT=1" on a CONFIG_KUNIT kernel; the suites run when the
+ * module loads.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <sound/pcm.h>
+
+#include "sl3.h"
+
+/* Buffer sizes in frames, none of them a power of two */
+static const snd_pcm_uframes_t sl3_test_buffers[] = {
+	1000, 1764, 4410, 6000, 65537, 480000,
+};
+
+/* A substream with the runtime state the driver reads */
+struct sl3_test_pcm {
+	struct snd_pcm_substream sub;
+	struct snd_pcm_runtime runtime;
+	struct snd_pcm_mmap_status status;
+	struct snd_pcm_mmap_control control;
+};
+
+static void sl3_test_pcm_state(struct sl3_test_pcm *p, snd_pcm_state_t state)
+{
+	p->runtime.state = state;
+	p->status.state = state;
+}
+
+/* Set up a running PCM of @buffer_size frames, boundary as the core has it */
+static void sl3_test_pcm_init(struct sl3_test_pcm *p,
+			      snd_pcm_uframes_t buffer_size, int stream)
+{
+	struct snd_pcm_runtime *runtime = &p->runtime;
+
+	runtime->buffer_size = buffer_size;
+	runtime->period_size = buffer_size / 4;
+	runtime->boundary = buffer_size;
+	while (runtime->boundary * 2 <= LONG_MAX - buffer_size)
+		runtime->boundary *= 2;
+	runtime->stop_threshold = buffer_size;
+	runtime->frame_bits = SL3_BYTES_PER_FRAME * 8;
+	runtime->rate = 44100;
+	runtime->status = &p->status;
+	runtime->control = &p->control;
+	p->sub.runtime = runtime;
+	p->sub.stream = stream;
+	sl3_test_pcm_state(p, SNDRV_PCM_STATE_RUNNING);
+}
+
+/* Start the core's view at frame @frames, as if it had tracked it so far */
+static void sl3_test_pcm_seek(struct sl3_test_pcm *p, u64 frames)
+{
+	p->status.hw_ptr = frames;
+	p->runtime.hw_ptr_base = frames - frames % p->runtime.buffer_size;
+}
+
+/*
+ * What the PCM core makes of a pointer value @pos: hw_ptr moves to the
+ * same offset in the current buffer, or in the next one if that would
+ * go backwards.
+ */
+static void sl3_test_core_update(struct sl3_test_pcm *p, snd_pcm_uframes_t pos)
+{
+	struct snd_pcm_runtime *runtime = &p->runtime;
+	snd_pcm_uframes_t base = runtime->hw_ptr_base;
+
+	if (base + pos < p->status.hw_ptr) {
+		base += runtime->buffer_size;
+		if (base >= runtime->boundary)
+			base = 0;
+	}
+	runtime->hw_ptr_base = base;
+	p->status.hw_ptr = base + pos;
+}
+
+/* Frames per 8-packet URB at 44.1 kHz: 44 or 45, as the fraction goes */
+static unsigned int sl3_test_urb_frames(unsigned int *acc)
+{
+	unsigned int frames = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		frames += 5;
+		*acc += 4100;
+		if (*acc >= SL3_MICROFRAMES_PER_SEC) {
+			*acc -= SL3_MICROFRAMES_PER_SEC;
+			frames++;
+		}
+	}
+	return frames;
+}
+
+/* sl3_ring_pos() steps by exactly the frames moved across 2^32 */
+static void sl3_test_ring_pos_wrap(struct kunit *test)
+{
+	struct snd_pcm_runtime runtime = { };
+	int b;
+
+	for (b = 0; b < ARRAY_SIZE(sl3_test_buffers); b++) {
+		unsigned int acc = 0, pos, next;
+		u64 frames = (1ULL << 32) - 3 * sl3_test_buffers[b] - 7;
+		int i;
+
+		runtime.buffer_size = sl3_test_buffers[b];
+		pos = sl3_ring_pos(frames, &runtime);
+
+		/* Six buffers either side of the old wrap point */
+		for (i = 0; i < 6 * runtime.buffer_size / 44; i++) {
+			unsigned int step = sl3_test_urb_frames(&acc);
+
+			frames += step;
+			next = sl3_ring_pos(frames, &runtime);
+			KUNIT_ASSERT_LT(test, next, (unsigned int)runtime.buffer_size);
+			KUNIT_ASSERT_EQ(test, next,
+					(pos + step) % (unsigned int)runtime.buffer_size);
+			pos = next;
+		}
+		KUNIT_EXPECT_GT(test, frames, 1ULL << 32);
+	}
+}
+
+/*
+ * Playback across 2^32: the driver copies URB by URB while the
+ * application stays half a buffer ahead, and the core reads the pointer
+ * every other URB.  Between reads sl3_stream_ahead() must count exactly
+ * the frames copied since, sl3_playback_queued() what the application
+ * has written beyond them, and after each read the core's hw_ptr must
+ * be where sl3_pcm_position() put it.  In zero-copy mode that is behind
+ * the URB still in flight.
+ */
+static void sl3_test_pointer_tracks(struct kunit *test, bool zerocopy)
+{
+	struct sl3_stream *stream;
+	struct sl3_test_pcm *p;
+	int b;
+
+	stream = kunit_kzalloc(test, sizeof(*stream), GFP_KERNEL);
+	p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, stream);
+	KUNIT_ASSERT_NOT_NULL(test, p);
+
+	for (b = 0; b < ARRAY_SIZE(sl3_test_buffers); b++) {
+		struct snd_pcm_runtime *runtime = &p->runtime;
+		u64 start = (1ULL << 32) - 3 * sl3_test_buffers[b] - 7;
+		unsigned int acc = 0, moved = 0;
+		int i;
+
+		sl3_test_pcm_init(p, sl3_test_buffers[b],
+				  SNDRV_PCM_STREAM_PLAYBACK);
+		stream->running = zerocopy;
+		stream->zerocopy = zerocopy;
+		stream->ring_inflight = 0;
+		stream->hwptr = start;
+		sl3_test_pcm_seek(p, start);
+		p->control.appl_ptr = start + runtime->buffer_size / 2;
+
+		for (i = 0; i < 6 * runtime->buffer_size / 44; i++) {
+			unsigned int step = sl3_test_urb_frames(&acc);
+			u64 expect;
+
+			stream->hwptr += step;
+			if (zerocopy)
+				stream->ring_inflight = step;
+			moved += step;
+			KUNIT_ASSERT_EQ(test, sl3_stream_ahead(stream, runtime),
+					(snd_pcm_uframes_t)moved);
+			KUNIT_ASSERT_EQ(test,
+					sl3_playback_queued(stream, runtime),
+					(snd_pcm_sframes_t)(p->control.appl_ptr -
+							    stream->hwptr));
+
+			p->control.appl_ptr += step;
+			if (i % 2)
+				continue;
+
+			sl3_test_core_update(p,
+				sl3_ring_pos(sl3_pcm_position(stream, true),
+					     runtime));
+			expect = stream->hwptr - stream->ring_inflight;
+			KUNIT_ASSERT_EQ(test, (u64)p->status.hw_ptr, expect);
+			moved = stream->ring_inflight;
+		}
+		KUNIT_EXPECT_GT(test, stream->hwptr, 1ULL << 32);
+	}
+}
+
+static void sl3_test_pointer_wrap(struct kunit *test)
+{
+	sl3_test_pointer_tracks(test, false);
+}
+
+static void sl3_test_pointer_wrap_zerocopy(struct kunit *test)
+{
+	sl3_test_pointer_tracks(test, true);
+}
+
+static struct kunit_case sl3_position_cases[] = {
+	KUNIT_CASE(sl3_test_ring_pos_wrap),
+	KUNIT_CASE(sl3_test_pointer_wrap),
+	KUNIT_CASE(sl3_test_pointer_wrap_zerocopy),
+	{ }
+};
+
+static struct kunit_suite sl3_position_suite = {
+	.name = "snd-rane-sl3-position",
+	.test_cases = sl3_position_cases,
+};
+
+/* A device and one running PCM, its position at 2^32 frames */
+struct sl3_test_xrun {
+	struct sl3_device dev;
+	struct sl3_test_pcm pcm;
+};
+
+static struct sl3_test_xrun *sl3_test_xrun_init(struct kunit *test,
+						int stream_dir)
+{
+	struct sl3_test_xrun *x;
+	struct sl3_stream *stream;
+
+	x = kunit_kzalloc(test, sizeof(*x), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, x);
+
+	sl3_test_pcm_init(&x->pcm, 4410, stream_dir);
+	sl3_test_pcm_seek(&x->pcm, 1ULL << 32);
+	x->pcm.control.appl_ptr = 1ULL << 32;
+	stream = stream_dir == SNDRV_PCM_STREAM_PLAYBACK ?
+		 &x->dev.playback : &x->dev.capture;
+	stream->hwptr = 1ULL << 32;
+	stream->xrun_policy = SL3_XRUN_CONTINUE;
+	return x;
+}
+
+/* Playback: one underrun per episode, however many URBs it lasts */
+static void sl3_test_underrun_once(struct kunit *test)
+{
+	struct sl3_test_xrun *x;
+	unsigned int frames;
+	int i;
+
+	x = sl3_test_xrun_init(test, SNDRV_PCM_STREAM_PLAYBACK);
+	x->pcm.control.appl_ptr += 20;
+
+	for (i = 0; i < 4; i++) {
+		frames = 44;
+		KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev,
+							      &x->pcm.sub,
+							      &frames));
+		KUNIT_EXPECT_EQ(test, frames, 44U);
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.play_underruns), 1);
+	KUNIT_EXPECT_FALSE(test, x->dev.playback.xrun_pending);
+
+	/* The application catches up, then falls behind again */
+	x->pcm.control.appl_ptr += 1000;
+	KUNIT_EXPECT_FALSE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						       &frames));
+	KUNIT_EXPECT_FALSE(test, x->dev.playback.in_xrun);
+	x->dev.playback.hwptr += 1000;
+	KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						      &frames));
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.play_underruns), 2);
+}
+
+/* SL3_XRUN_STOP stops the PCM, unless it was asked to free-run */
+static void sl3_test_underrun_stop(struct kunit *test)
+{
+	struct sl3_test_xrun *x;
+	unsigned int frames = 44;
+
+	x = sl3_test_xrun_init(test, SNDRV_PCM_STREAM_PLAYBACK);
+	x->dev.playback.xrun_policy = SL3_XRUN_STOP;
+	KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						      &frames));
+	KUNIT_EXPECT_TRUE(test, x->dev.playback.xrun_pending);
+
+	x->dev.playback.xrun_pending = false;
+	x->pcm.runtime.stop_threshold = x->pcm.runtime.boundary;
+	KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						      &frames));
+	KUNIT_EXPECT_FALSE(test, x->dev.playback.xrun_pending);
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.play_underruns), 1);
+}
+
+/* A drain sends what is left, then silence, and is no underrun */
+static void sl3_test_underrun_drain(struct kunit *test)
+{
+	struct sl3_test_xrun *x;
+	unsigned int frames = 44;
+
+	x = sl3_test_xrun_init(test, SNDRV_PCM_STREAM_PLAYBACK);
+	sl3_test_pcm_state(&x->pcm, SNDRV_PCM_STATE_DRAINING);
+	x->pcm.control.appl_ptr += 10;
+	KUNIT_EXPECT_FALSE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						       &frames));
+	KUNIT_EXPECT_EQ(test, frames, 10U);
+
+	x->dev.playback.hwptr += frames;
+	frames = 44;
+	KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						      &frames));
+	KUNIT_EXPECT_EQ(test, frames, 0U);
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.play_underruns), 0);
+}
+
+/* A rewind past frames already sent: silence, not an underrun */
+static void sl3_test_underrun_rewind(struct kunit *test)
+{
+	struct sl3_test_xrun *x;
+	unsigned int frames = 44;
+
+	x = sl3_test_xrun_init(test, SNDRV_PCM_STREAM_PLAYBACK);
+	x->dev.playback.xrun_policy = SL3_XRUN_STOP;
+	x->dev.playback.hwptr += 30;
+	KUNIT_EXPECT_TRUE(test, sl3_playback_underrun(&x->dev, &x->pcm.sub,
+						      &frames));
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.play_underruns), 0);
+	KUNIT_EXPECT_FALSE(test, x->dev.playback.xrun_pending);
+	KUNIT_EXPECT_EQ(test, sl3_urb_playback_overlap(&x->dev.playback,
+						       &x->pcm.runtime), 30UL);
+}
+
+/*
+ * Capture: an URB that would overwrite unread frames is dropped and
+ * counted once; a stopped PCM never overruns.
+ */
+static void sl3_test_overrun(struct kunit *test)
+{
+	struct sl3_test_xrun *x;
+	snd_pcm_uframes_t size;
+	int i;
+
+	x = sl3_test_xrun_init(test, SNDRV_PCM_STREAM_CAPTURE);
+	size = x->pcm.runtime.buffer_size;
+	x->pcm.control.appl_ptr -= size - 40;
+
+	KUNIT_EXPECT_FALSE(test, sl3_capture_overrun(&x->dev, &x->pcm.sub, 40));
+	for (i = 0; i < 3; i++)
+		KUNIT_EXPECT_TRUE(test, sl3_capture_overrun(&x->dev,
+							    &x->pcm.sub, 44));
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.cap_overruns), 1);
+
+	/* Frames copied but not yet reported count as unread too */
+	x->pcm.control.appl_ptr += 50;
+	x->dev.capture.hwptr += 60;
+	KUNIT_EXPECT_TRUE(test, sl3_capture_overrun(&x->dev, &x->pcm.sub, 44));
+	KUNIT_EXPECT_FALSE(test, sl3_capture_overrun(&x->dev, &x->pcm.sub, 30));
+	KUNIT_EXPECT_FALSE(test, x->dev.capture.in_xrun);
+
+	sl3_test_pcm_state(&x->pcm, SNDRV_PCM_STATE_XRUN);
+	KUNIT_EXPECT_FALSE(test, sl3_capture_overrun(&x->dev, &x->pcm.sub,
+						     size));
+	KUNIT_EXPECT_EQ(test, atomic_read(&x->dev.cap_overruns), 1);
+}
+
+static struct kunit_case sl3_xrun_cases[] = {
+	KUNIT_CASE(sl3_test_underrun_once),
+	KUNIT_CASE(sl3_test_underrun_stop),
+	KUNIT_CASE(sl3_test_underrun_drain),
+	KUNIT_CASE(sl3_test_underrun_rewind),
+	KUNIT_CASE(sl3_test_overrun),
+	{ }
+};
+
+static struct kunit_suite sl3_xrun_suite = {
+	.name = "snd-rane-sl3-xrun",
+	.test_cases = sl3_xrun_cases,
+};
+
+/* A device with both queues streaming and both PCMs running */
+static struct sl3_device *sl3_test_keepalive_init(struct kunit *test,
+						  unsigned int keepalive)
+{
+	struct sl3_stream *streams[2];
+	struct sl3_device *dev;
+	int i;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	dev->keepalive = keepalive;
+
+	streams[0] = &dev->playback;
+	streams[1] = &dev->capture;
+	for (i = 0; i < ARRAY_SIZE(streams); i++) {
+		streams[i]->num_urbs = 2;
+		streams[i]->urbs = kunit_kzalloc(test,
+						 2 * sizeof(*streams[i]->urbs),
+						 GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, streams[i]->urbs);
+		streams[i]->running = true;
+		streams[i]->active = true;
+	}
+	return dev;
+}
+
+/*
+ * With keepalive a PCM stop only stops moving ring data; the next START
+ * takes the queue over as it streams, without submitting anything.
+ */
+static void sl3_test_keepalive_switch(struct kunit *test)
+{
+	struct sl3_device *dev = sl3_test_keepalive_init(test, 5);
+
+	sl3_urb_stop_async(dev, &dev->playback);
+	KUNIT_EXPECT_FALSE(test, dev->playback.active);
+	KUNIT_EXPECT_TRUE(test, dev->playback.running);
+	KUNIT_EXPECT_TRUE(test, dev->capture.running);
+
+	sl3_urb_stop_async(dev, &dev->capture);
+	KUNIT_EXPECT_FALSE(test, dev->capture.active);
+	KUNIT_EXPECT_TRUE(test, dev->capture.running);
+
+	KUNIT_EXPECT_EQ(test, sl3_urb_start(dev, &dev->playback, NULL), 0);
+	KUNIT_EXPECT_TRUE(test, dev->playback.active);
+	KUNIT_EXPECT_TRUE(test, dev->playback.start_pending);
+	KUNIT_EXPECT_EQ(test, dev->playback.start_ns, 0);
+	KUNIT_EXPECT_FALSE(test, dev->capture.active);
+
+	KUNIT_EXPECT_EQ(test, sl3_urb_start(dev, &dev->capture, NULL), 0);
+	KUNIT_EXPECT_TRUE(test, dev->capture.active);
+}
+
+/* Without keepalive a stop ends the queue, and implicit capture with it */
+static void sl3_test_keepalive_off(struct kunit *test)
+{
+	struct sl3_device *dev = sl3_test_keepalive_init(test, 0);
+
+	/* Capture feeds running playback, so it keeps streaming */
+	sl3_urb_stop_async(dev, &dev->capture);
+	KUNIT_EXPECT_FALSE(test, dev->capture.active);
+	KUNIT_EXPECT_TRUE(test, dev->capture.running);
+
+	sl3_urb_stop_async(dev, &dev->playback);
+	KUNIT_EXPECT_FALSE(test, dev->playback.running);
+	KUNIT_EXPECT_FALSE(test, dev->capture.running);
+}
+
+/* Playback straight from the ring buffer is never kept streaming */
+static void sl3_test_keepalive_direct(struct kunit *test)
+{
+	struct sl3_device *dev;
+
+	dev = sl3_test_keepalive_init(test, 5);
+	dev->playback.lowlatency = true;
+	KUNIT_EXPECT_FALSE(test, sl3_urb_keepalive(dev, &dev->playback));
+	KUNIT_EXPECT_TRUE(test, sl3_urb_keepalive(dev, &dev->capture));
+	sl3_urb_stop_async(dev, &dev->playback);
+	KUNIT_EXPECT_FALSE(test, dev->playback.running);
+	KUNIT_EXPECT_TRUE(test, dev->capture.running);
+
+	dev = sl3_test_keepalive_init(test, 5);
+	dev->playback.zerocopy = true;
+	sl3_urb_stop_async(dev, &dev->playback);
+	KUNIT_EXPECT_FALSE(test, dev->playback.running);
+}
+
+static struct kunit_case sl3_keepalive_cases[] = {
+	KUNIT_CASE(sl3_test_keepalive_switch),
+	KUNIT_CASE(sl3_test_keepalive_off),
+	KUNIT_CASE(sl3_test_keepalive_direct),
+	{ }
+};
+
+static struct kunit_suite sl3_keepalive_suite = {
+	.name = "snd-rane-sl3-keepalive",
+	.test_cases = sl3_keepalive_cases,
+};
+
+/* Copies per measurement; each one straddles the end of the ring */
+#define SL3_TEST_COPY_URBS	4096
+
+/*
+ * Fill a playback URB of @packets 6-frame packets SL3_TEST_COPY_URBS
+ * times, every one of them straddling the end of the ring, and return
+ * the mean copy time in ns.  @out receives the last URB's payload.
+ */
+static u64 sl3_test_copy_run(struct kunit *test, struct sl3_device *dev,
+			     struct sl3_test_pcm *p, struct sl3_urb_ctx *ctx,
+			     u8 *out)
+{
+	struct sl3_stream *stream = &dev->playback;
+	struct urb *urb = ctx->urb;
+	u64 start = p->runtime.buffer_size * 3 - ctx->frames / 2;
+	int i;
+
+	stream->copy_ns = 0;
+	stream->copy_urbs = 0;
+	for (i = 0; i < SL3_TEST_COPY_URBS; i++) {
+		stream->hwptr = start;
+		sl3_test_pcm_seek(p, start);
+		p->control.appl_ptr = start + p->runtime.buffer_size / 2;
+		sl3_copy_playback_urb(dev, ctx);
+		KUNIT_ASSERT_EQ(test, stream->hwptr, start + ctx->frames);
+	}
+	memcpy(out, urb->transfer_buffer, urb->transfer_buffer_length);
+
+	KUNIT_ASSERT_EQ(test, stream->copy_urbs, (u64)SL3_TEST_COPY_URBS);
+	return div_u64(stream->copy_ns, stream->copy_urbs);
+}
+
+/*
+ * URBs across the end of the ring: a mirrored ring takes them in one
+ * copy, a plain one in two.  Both must send the same audio; the mean
+ * copy times of each go to the test log.
+ */
+static void sl3_test_copy_mirror(struct kunit *test)
+{
+	static const unsigned int packets[] = { SL3_ISO_PACKETS,
+						SL3_MAX_ISO_PACKETS };
+	struct sl3_device *dev;
+	struct sl3_test_pcm *p;
+	struct sl3_urb_ctx *ctx;
+	unsigned int buf_bytes, len;
+	u8 *split, *mirrored;
+	int i, k;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	KUNIT_ASSERT_NOT_NULL(test, p);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+	sl3_test_pcm_init(p, 4410, SNDRV_PCM_STREAM_PLAYBACK);
+	buf_bytes = p->runtime.buffer_size * SL3_BYTES_PER_FRAME;
+
+	/* The mirror maps the ring's pages again right after it */
+	p->runtime.dma_area = kunit_kzalloc(test, 2 * buf_bytes, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, p->runtime.dma_area);
+	for (i = 0; i < buf_bytes; i++)
+		p->runtime.dma_area[i] = i * 7 + (i >> 8);
+	memcpy(p->runtime.dma_area + buf_bytes, p->runtime.dma_area,
+	       buf_bytes);
+
+	dev->playback.substream = &p->sub;
+	dev->playback.active = true;
+	dev->playback.xrun_policy = SL3_XRUN_CONTINUE;
+
+	for (k = 0; k < ARRAY_SIZE(packets); k++) {
+		u64 split_ns, mirror_ns;
+
+		len = packets[k] * 6 * SL3_BYTES_PER_FRAME;
+		ctx->urb = kunit_kzalloc(test, sizeof(*ctx->urb) +
+					 packets[k] *
+					 sizeof(ctx->urb->iso_frame_desc[0]),
+					 GFP_KERNEL);
+		ctx->buffer = kunit_kzalloc(test, len, GFP_KERNEL);
+		split = kunit_kzalloc(test, len, GFP_KERNEL);
+		mirrored = kunit_kzalloc(test, len, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, ctx->urb);
+		KUNIT_ASSERT_NOT_NULL(test, ctx->buffer);
+		KUNIT_ASSERT_NOT_NULL(test, split);
+		KUNIT_ASSERT_NOT_NULL(test, mirrored);
+
+		ctx->urb->number_of_packets = packets[k];
+		ctx->urb->transfer_buffer_length = len;
+		for (i = 0; i < packets[k]; i++) {
+			ctx->urb->iso_frame_desc[i].offset =
+				i * 6 * SL3_BYTES_PER_FRAME;
+			ctx->urb->iso_frame_desc[i].length =
+				6 * SL3_BYTES_PER_FRAME;
+		}
+		ctx->frames = packets[k] * 6;
+
+		dev->playback.mirror = false;
+		split_ns = sl3_test_copy_run(test, dev, p, ctx, split);
+		dev->playback.mirror = true;
+		mirror_ns = sl3_test_copy_run(test, dev, p, ctx, mirrored);
+
+		KUNIT_EXPECT_MEMEQ(test, split, mirrored, len);
+		KUNIT_EXPECT_MEMEQ(test, mirrored,
+				   p->runtime.dma_area + buf_bytes - len / 2,
+				   len);
+		kunit_info(test, "%u-packet URB across the ring end: split %llu ns, mirrored %llu ns\n",
+			   packets[k], split_ns, mirror_ns);
+	}
+}
+
+static struct kunit_case sl3_copy_cases[] = {
+	KUNIT_CASE(sl3_test_copy_mirror),
+	{ }
+};
+
+static struct kunit_suite sl3_copy_suite = {
+	.name = "snd-rane-sl3-copy",
+	.test_cases = sl3_copy_cases,
+};
+
+kunit_test_suites(&sl3_position_suite, &sl3_xrun_suite,
+		  &sl3_keepalive_suite, &sl3_copy_suite);
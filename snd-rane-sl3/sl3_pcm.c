@@ -3,12 +3,20 @@
  * Rane SL3 USB Audio Interface - ALSA PCM Device
  *
  * Registers an ALSA sound card with a 6-channel PCM device.
- * Implements PCM operations: open, close, hw_params, prepare, trigger, pointer.
+ * Implements PCM operations: open, close, hw_params, hw_free, prepare, trigger,
+ * pointer, get_time_info (USB link timestamps), mmap (mirrored buffers) and
+ * ack (low-latency playback).
  * Also contains the sample rate switching sequence (sl3_set_sample_rate).
  */
 
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/gcd.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <kunit/visibility.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/initval.h>
@@ -19,7 +27,10 @@ static const struct snd_pcm_hardware sl3_pcm_hw = {
 	.info =			SNDRV_PCM_INFO_MMAP |
 				SNDRV_PCM_INFO_MMAP_VALID |
 				SNDRV_PCM_INFO_INTERLEAVED |
-				SNDRV_PCM_INFO_BLOCK_TRANSFER,
+				SNDRV_PCM_INFO_BLOCK_TRANSFER |
+				SNDRV_PCM_INFO_NO_PERIOD_WAKEUP |
+				SNDRV_PCM_INFO_HAS_LINK_ATIME |
+				SNDRV_PCM_INFO_SYNC_START,
 	.formats =		SNDRV_PCM_FMTBIT_S24_3LE,
 	.rates =		SNDRV_PCM_RATE_44100 |
 				SNDRV_PCM_RATE_48000,
@@ -27,9 +38,9 @@ static const struct snd_pcm_hardware sl3_pcm_hw = {
 	.rate_max =		48000,
 	.channels_min =		SL3_NUM_CHANNELS,
 	.channels_max =		SL3_NUM_CHANNELS,
-	.buffer_bytes_max =	256 * 1024,
+	.buffer_bytes_max =	SL3_BUFFER_BYTES_MAX,
 	.period_bytes_min =	SL3_BYTES_PER_FRAME,
-	.period_bytes_max =	128 * 1024,
+	.period_bytes_max =	SL3_BUFFER_BYTES_MAX / 2,
 	.periods_min =		2,
 	.periods_max =		1024,
 };
@@ -68,10 +79,88 @@ static int sl3_pcm_hw_rule_rate(struct snd_pcm_hw_params *params,
 	return snd_interval_refine(rate, &constraint);
 }
 
+static struct sl3_stream *sl3_pcm_stream(struct snd_pcm_substream *substream)
+{
+	struct sl3_device *dev = snd_pcm_substream_chip(substream);
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &dev->playback;
+	return &dev->capture;
+}
+
+/*
+ * Mirrored ring buffer: the buffer pages are mapped twice back to back in
+ * kernel virtual space, so a packet copy that runs past the end of the
+ * ring lands at its start and never has to be split.  The buffer size is
+ * constrained to whole pages at open time.
+ */
+static int sl3_pcm_mirror_alloc(struct sl3_stream *stream,
+				struct snd_pcm_runtime *runtime, size_t bytes)
+{
+	unsigned int npages = PAGE_ALIGN(bytes) >> PAGE_SHIFT;
+	struct page **pages;
+	unsigned int i;
+	void *area;
+
+	pages = kvcalloc(2 * npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < npages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!pages[i])
+			goto err_free_pages;
+		pages[npages + i] = pages[i];
+	}
+
+	area = vmap(pages, 2 * npages, VM_MAP, PAGE_KERNEL);
+	if (!area)
+		goto err_free_pages;
+
+	stream->mirror_pages = pages;
+	stream->mirror_npages = npages;
+	runtime->dma_area = area;
+	runtime->dma_addr = 0;
+	runtime->dma_bytes = bytes;
+	return 0;
+
+err_free_pages:
+	while (i--)
+		__free_page(pages[i]);
+	kvfree(pages);
+	return -ENOMEM;
+}
+
+static void sl3_pcm_mirror_free(struct sl3_stream *stream,
+				struct snd_pcm_runtime *runtime)
+{
+	unsigned long flags;
+	unsigned int i;
+	void *area;
+
+	if (!stream->mirror_pages)
+		return;
+
+	/* Completions check dma_area under the lock before copying */
+	spin_lock_irqsave(&stream->lock, flags);
+	area = runtime->dma_area;
+	runtime->dma_area = NULL;
+	runtime->dma_bytes = 0;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	vunmap(area);
+	for (i = 0; i < stream->mirror_npages; i++)
+		__free_page(stream->mirror_pages[i]);
+	kvfree(stream->mirror_pages);
+	stream->mirror_pages = NULL;
+	stream->mirror_npages = 0;
+}
+
 static int sl3_pcm_open(struct snd_pcm_substream *substream)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;
+	int err;
 
 	if (dev->disconnected)
 		return -ENODEV;
@@ -79,10 +168,47 @@ static int sl3_pcm_open(struct snd_pcm_substream *substream)
 	runtime->hw = sl3_pcm_hw;
 
 	/* Store substream reference */
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
 		dev->playback.substream = substream;
-	else
+		/*
+		 * These queue from the ring itself, so start from scratch.
+		 * Keepalive completions must not see the new mode before
+		 * its queue is gone.
+		 */
+		if (dev->lowlatency || dev->zerocopy) {
+			mutex_lock(&dev->stream_mutex);
+			sl3_urb_stop(dev, &dev->playback);
+			mutex_unlock(&dev->stream_mutex);
+		}
+		dev->playback.lowlatency = dev->lowlatency;
+		/*
+		 * The zero-copy buffer is preallocated DMA-coherent memory.
+		 * Its pointer trails the frames URBs still read from it, so
+		 * the rewindable window would include frames .ack refuses.
+		 */
+		if (dev->zerocopy) {
+			runtime->hw.buffer_bytes_max = SL3_ZEROCOPY_BYTES_MAX;
+			runtime->hw.period_bytes_max = SL3_ZEROCOPY_BYTES_MAX / 2;
+			runtime->hw.info |= SNDRV_PCM_INFO_NO_REWINDS;
+		}
+		/* Make mmap clients report appl_ptr moves so .ack runs */
+		if (dev->playback.lowlatency)
+			runtime->hw.info |= SNDRV_PCM_INFO_SYNC_APPLPTR;
+	} else {
 		dev->capture.substream = substream;
+	}
+
+	/* A mirrored ring must be whole pages so the second mapping abuts */
+	if (sl3_pcm_stream(substream)->mirror) {
+		err = snd_pcm_hw_constraint_step(runtime, 0,
+				SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+				PAGE_SIZE / gcd(PAGE_SIZE, SL3_BYTES_PER_FRAME));
+		if (err < 0)
+			return err;
+	}
+
+	/* Both directions share the card's clock, so they can be linked */
+	snd_pcm_set_sync(substream);
 
 	/* Add rate constraint: both streams must use the same rate */
 	snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
@@ -92,20 +218,32 @@ static int sl3_pcm_open(struct snd_pcm_substream *substream)
 	return 0;
 }
 
+/*
+ * Wait for the URBs of a stream the trigger stopped, and for those of
+ * the implicit capture stopping playback also stopped.
+ */
+static void sl3_pcm_drain(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	mutex_lock(&dev->stream_mutex);
+	sl3_urb_drain(dev, stream);
+	if (stream == &dev->playback)
+		sl3_urb_drain(dev, &dev->capture);
+	mutex_unlock(&dev->stream_mutex);
+}
+
 static int sl3_pcm_close(struct snd_pcm_substream *substream)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
-	struct sl3_stream *stream;
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &dev->playback;
-	else
-		stream = &dev->capture;
+	struct sl3_stream *stream = sl3_pcm_stream(substream);
 
-	/* Kill any lingering URBs (safe to call even if already stopped) */
-	sl3_urb_stop(dev, stream);
+	/* Stop lingering URBs unless keepalive keeps the endpoint going */
+	sl3_urb_stop_async(dev, stream);
+	sl3_pcm_drain(dev, stream);
 	stream->substream = NULL;
 
+	if (!dev->playback.substream && !dev->capture.substream)
+		sl3_urb_keepalive_idle(dev);
+
 	return 0;
 }
 
@@ -113,19 +251,54 @@ static int sl3_pcm_hw_params(struct snd_pcm_substream *substream,
 			     struct snd_pcm_hw_params *params)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
+	struct sl3_stream *stream = sl3_pcm_stream(substream);
 	unsigned int rate = params_rate(params);
+	int err;
 
 	if (dev->disconnected)
 		return -ENODEV;
 
 	/* Use the full rate switching sequence (handles URB stop/restart) */
-	return sl3_set_sample_rate(dev, rate);
+	err = sl3_set_sample_rate(dev, rate);
+	if (err)
+		return err;
+
+	if (!stream->mirror)
+		return 0;
+
+	/* Unmanaged mirrored buffer: reallocate for the new size */
+	sl3_pcm_mirror_free(stream, substream->runtime);
+	return sl3_pcm_mirror_alloc(stream, substream->runtime,
+				    params_buffer_bytes(params));
+}
+
+static int sl3_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	sl3_pcm_mirror_free(sl3_pcm_stream(substream), substream->runtime);
+	return 0;
+}
+
+/*
+ * mmap of a mirrored buffer maps its pages once; everything else goes
+ * through the core's default handler.
+ */
+static int sl3_pcm_mmap(struct snd_pcm_substream *substream,
+			struct vm_area_struct *area)
+{
+	struct sl3_stream *stream = sl3_pcm_stream(substream);
+
+	if (!stream->mirror_pages)
+		return snd_pcm_lib_default_mmap(substream, area);
+
+	return vm_map_pages(area, stream->mirror_pages,
+			    stream->mirror_npages);
 }
 
 static int sl3_pcm_prepare(struct snd_pcm_substream *substream)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
 	struct sl3_stream *stream;
+	int err;
 
 	if (dev->disconnected)
 		return -ENODEV;
@@ -135,12 +308,41 @@ static int sl3_pcm_prepare(struct snd_pcm_substream *substream)
 	else
 		stream = &dev->capture;
 
+	/* Drain the last run's URBs and apply any queue geometry change */
+	mutex_lock(&dev->stream_mutex);
+	err = sl3_urb_prepare(dev, stream);
+	if (!err && stream == &dev->playback)
+		err = sl3_urb_prepare(dev, &dev->capture);
+	mutex_unlock(&dev->stream_mutex);
+	if (err)
+		return err;
+
 	stream->hwptr = 0;
 	stream->transfer_done = 0;
 
 	return 0;
 }
 
+/*
+ * Start a substream together with the other direction of this card if
+ * the two are linked, so both endpoints begin on the same microframe.
+ */
+static int sl3_pcm_start(struct sl3_device *dev,
+			 struct snd_pcm_substream *substream)
+{
+	struct sl3_stream *linked = NULL;
+	struct snd_pcm_substream *s;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s == substream || snd_pcm_substream_chip(s) != dev)
+			continue;
+		linked = sl3_pcm_stream(s);
+		snd_pcm_trigger_done(s, substream);
+	}
+
+	return sl3_urb_start(dev, sl3_pcm_stream(substream), linked);
+}
+
 static int sl3_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
@@ -155,35 +357,192 @@ static int sl3_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		return sl3_urb_start(dev, stream);
+		return sl3_pcm_start(dev, substream);
 	case SNDRV_PCM_TRIGGER_STOP:
-		stream->running = false;
-		/* Stop implicit capture if playback no longer needs it */
-		if (is_playback && dev->capture.running &&
-		    !dev->capture.substream)
-			dev->capture.running = false;
+		sl3_urb_stop_async(dev, stream);
 		return 0;
 	default:
 		return -EINVAL;
 	}
 }
 
+static int sl3_pcm_ack(struct snd_pcm_substream *substream)
+{
+	struct sl3_device *dev = snd_pcm_substream_chip(substream);
+
+	if (dev->disconnected)
+		return -ENODEV;
+
+	return sl3_urb_playback_ack(dev);
+}
+
+/*
+ * The trigger only starts cancelling the queue.  Wait for the URBs of a
+ * stopped stream here, before the core frees or reallocates the buffer
+ * (zero-copy URBs read it until they complete) or prepares it again.
+ * Keepalive streams no longer touch the buffer once the trigger returns.
+ */
+static int sl3_pcm_sync_stop(struct snd_pcm_substream *substream)
+{
+	struct sl3_device *dev = snd_pcm_substream_chip(substream);
+
+	sl3_pcm_drain(dev, sl3_pcm_stream(substream));
+	return 0;
+}
+
+/*
+ * Frames that have gone over the bus since the last completion,
+ * estimated from its time at the nominal rate.  At most the frames the
+ * next batch of completions will account for.  Called under
+ * stream->lock.
+ */
+static unsigned int sl3_pcm_bus_frames(struct sl3_stream *stream,
+				       struct snd_pcm_runtime *runtime)
+{
+	unsigned int est;
+	s64 elapsed;
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), stream->last_complete));
+	if (elapsed < 0)
+		elapsed = 0;
+
+	est = div_u64((u64)elapsed * runtime->rate, NSEC_PER_SEC);
+	return min(est, stream->ptr_step);
+}
+
+/*
+ * Playback reports the frames committed to URBs, so that everything
+ * past the pointer can still be rewound; the time the queued frames
+ * take to play out is reported as delay instead.  Capture positions are
+ * exact: frames cannot be reported before they have landed in the ring
+ * buffer.  Called under stream->lock.
+ */
+VISIBLE_IF_KUNIT u64 sl3_pcm_position(struct sl3_stream *stream,
+				      bool is_playback)
+{
+	/* Zero-copy: frames still in flight must not be overwritten */
+	if (is_playback && stream->running && stream->zerocopy)
+		return stream->hwptr - stream->ring_inflight;
+
+	return stream->hwptr;
+}
+
+/*
+ * Frames beyond the reported position that are not yet at the
+ * converters.  For playback these are the frames queued to the device
+ * that the pointer has already passed: URBs in flight, silence
+ * included, less what has been played since the last completion.  For
+ * capture, the frames recorded since the last completion that have
+ * not reached the ring buffer yet.  The device's own converter latency
+ * is added to both.  Called under stream->lock.
+ */
+static snd_pcm_sframes_t sl3_pcm_delay(struct sl3_stream *stream,
+				       struct snd_pcm_runtime *runtime,
+				       u64 pos, bool is_playback)
+{
+	s64 delay = 0;
+	s64 queued;
+
+	if (stream->running && stream->ptr_step) {
+		delay = sl3_pcm_bus_frames(stream, runtime);
+		if (is_playback) {
+			/* Nominal rate: off by under a frame per URB */
+			queued = atomic_read(&stream->urbs_inflight);
+			queued = div_u64(queued * stream->num_packets *
+					 runtime->rate,
+					 SL3_MICROFRAMES_PER_SEC);
+			delay = queued - delay - (s64)(stream->hwptr - pos);
+		}
+	}
+
+	delay += div_u64((u64)READ_ONCE(stream->latency_us) * runtime->rate,
+			 USEC_PER_SEC);
+	return max_t(s64, delay, 0);
+}
+
 static snd_pcm_uframes_t sl3_pcm_pointer(struct snd_pcm_substream *substream)
 {
 	struct sl3_device *dev = snd_pcm_substream_chip(substream);
 	struct sl3_stream *stream;
-	unsigned int hwptr;
+	unsigned long flags;
+	u64 hwptr;
+	bool is_playback;
 
 	if (dev->disconnected)
 		return SNDRV_PCM_POS_XRUN;
 
+	is_playback = (substream->stream == SNDRV_PCM_STREAM_PLAYBACK);
+	stream = is_playback ? &dev->playback : &dev->capture;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	hwptr = sl3_pcm_position(stream, is_playback);
+	substream->runtime->delay = sl3_pcm_delay(stream, substream->runtime,
+						  hwptr, is_playback);
+	/* Never past appl_ptr, even when a rewind raced a completion */
+	if (is_playback && stream->active)
+		hwptr -= sl3_urb_playback_overlap(stream, substream->runtime);
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	return sl3_ring_pos(hwptr, substream->runtime);
+}
+
+/*
+ * Link timestamps: audio time is the USB bus time (in microframes, taken
+ * from the URB start frames) at the end of the last completed URB, and
+ * system time is when that completion ran, converted to the clock the
+ * application asked for.
+ */
+static int sl3_pcm_get_time_info(struct snd_pcm_substream *substream,
+				 struct timespec64 *system_ts,
+				 struct timespec64 *audio_ts,
+				 struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+				 struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct sl3_device *dev = snd_pcm_substream_chip(substream);
+	struct sl3_stream *stream;
+	struct timespec64 now;
+	unsigned long flags;
+	ktime_t last;
+	u64 uframes;
+	s64 age;
+	bool valid;
+
+	if (audio_tstamp_config->type_requested !=
+	    SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK) {
+		audio_tstamp_report->actual_type =
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
 	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
 		stream = &dev->playback;
 	else
 		stream = &dev->capture;
 
-	hwptr = stream->hwptr;
-	return hwptr % substream->runtime->buffer_size;
+	spin_lock_irqsave(&stream->lock, flags);
+	valid = stream->link_valid;
+	uframes = stream->link_uframes;
+	last = stream->last_complete;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	if (!valid) {
+		audio_tstamp_report->actual_type =
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	snd_pcm_gettime(substream->runtime, &now);
+	age = ktime_to_ns(ktime_sub(ktime_get(), last));
+	*system_ts = ns_to_timespec64(timespec64_to_ns(&now) - age);
+	*audio_ts = ns_to_timespec64(uframes * (NSEC_PER_SEC /
+						SL3_MICROFRAMES_PER_SEC));
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	/* Completion callbacks run within about a microframe of the bus */
+	audio_tstamp_report->accuracy = NSEC_PER_SEC / SL3_MICROFRAMES_PER_SEC;
+
+	return 0;
 }
 
 /*
@@ -206,11 +565,15 @@ int sl3_set_sample_rate(struct sl3_device *dev, unsigned int rate)
 	}
 
 	/* Cannot switch while a stream is actively running */
-	if (dev->playback.running || dev->capture.running) {
+	if (dev->playback.active || dev->capture.active) {
 		mutex_unlock(&dev->stream_mutex);
 		return -EBUSY;
 	}
 
+	/* Idle keepalive streaming restarts at the new rate */
+	sl3_urb_stop(dev, &dev->playback);
+	sl3_urb_stop(dev, &dev->capture);
+
 	/* Send HID rate change command and wait for 0xFF response */
 	err = sl3_hid_set_sample_rate(dev, rate);
 	if (err) {
@@ -225,6 +588,9 @@ int sl3_set_sample_rate(struct sl3_device *dev, unsigned int rate)
 
 	/* Reset fractional sample accumulator for 44.1kHz pattern */
 	dev->sample_accumulator = 0;
+	/* Packet sizes laid out at the old rate are stale */
+	dev->playback.laid_out = false;
+	dev->capture.laid_out = false;
 
 	dev_info(&dev->intf->dev, "sample rate switched to %u Hz\n", rate);
 
@@ -236,18 +602,27 @@ static const struct snd_pcm_ops sl3_playback_ops = {
 	.open =		sl3_pcm_open,
 	.close =	sl3_pcm_close,
 	.hw_params =	sl3_pcm_hw_params,
+	.hw_free =	sl3_pcm_hw_free,
 	.prepare =	sl3_pcm_prepare,
 	.trigger =	sl3_pcm_trigger,
+	.sync_stop =	sl3_pcm_sync_stop,
 	.pointer =	sl3_pcm_pointer,
+	.get_time_info = sl3_pcm_get_time_info,
+	.ack =		sl3_pcm_ack,
+	.mmap =		sl3_pcm_mmap,
 };
 
 static const struct snd_pcm_ops sl3_capture_ops = {
 	.open =		sl3_pcm_open,
 	.close =	sl3_pcm_close,
 	.hw_params =	sl3_pcm_hw_params,
+	.hw_free =	sl3_pcm_hw_free,
 	.prepare =	sl3_pcm_prepare,
 	.trigger =	sl3_pcm_trigger,
+	.sync_stop =	sl3_pcm_sync_stop,
 	.pointer =	sl3_pcm_pointer,
+	.get_time_info = sl3_pcm_get_time_info,
+	.mmap =		sl3_pcm_mmap,
 };
 
 static void sl3_card_private_free(struct snd_card *card)
@@ -262,6 +637,7 @@ int sl3_pcm_init(struct sl3_device *dev)
 {
 	struct snd_card *card;
 	struct snd_pcm *pcm;
+	struct snd_pcm_substream *playback, *capture;
 	int err;
 
 	err = snd_card_new(&dev->intf->dev, SNDRV_DEFAULT_IDX1,
@@ -289,8 +665,31 @@ int sl3_pcm_init(struct sl3_device *dev)
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &sl3_playback_ops);
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &sl3_capture_ops);
 
-	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL,
-				       0, 0);
+	playback = pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream;
+	capture = pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream;
+
+	/* Mirrored buffers are allocated in hw_params instead */
+	dev->capture.mirror = dev->mirror;
+	dev->playback.mirror = dev->mirror && !dev->zerocopy;
+
+	if (!dev->capture.mirror)
+		snd_pcm_set_managed_buffer(capture, SNDRV_DMA_TYPE_VMALLOC,
+					   NULL, 0, 0);
+
+	/*
+	 * Zero-copy playback needs a buffer the host controller can read
+	 * directly.  Isochronous URBs cannot use scatter-gather on xHCI or
+	 * EHCI, so this is one DMA-coherent block, preallocated to avoid
+	 * fragmentation failures at hw_params time.
+	 */
+	if (dev->zerocopy)
+		snd_pcm_set_managed_buffer(playback, SNDRV_DMA_TYPE_DEV,
+					   dev->udev->bus->sysdev,
+					   SL3_ZEROCOPY_BYTES_MAX,
+					   SL3_ZEROCOPY_BYTES_MAX);
+	else if (!dev->playback.mirror)
+		snd_pcm_set_managed_buffer(playback, SNDRV_DMA_TYPE_VMALLOC,
+					   NULL, 0, 0);
 
 	return 0;
 
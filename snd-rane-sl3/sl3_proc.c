@@ -5,12 +5,37 @@
  * Proc filesystem entries for device status and statistics
  */
 
+#include <linux/math64.h>
 #include <sound/info.h>
 
 #include "sl3.h"
 
 static const char * const route_names[] = { "Analog", "USB" };
 
+/* Streaming silence with no PCM started: kept alive or implicit capture */
+static const char *sl3_proc_state(struct sl3_stream *stream)
+{
+	if (!stream->running)
+		return "stopped";
+	return stream->active ? "running" : "idle";
+}
+
+/* Microframe the stream's audio started on, and the one asked for */
+static void sl3_proc_print_start(struct snd_info_buffer *buffer,
+				 const char *name, struct sl3_stream *stream)
+{
+	if (!stream->first_valid)
+		return;
+
+	if (stream->start_ns)
+		snd_iprintf(buffer, "  %-15s uframe %u (requested %u)\n", name,
+			    stream->first_frame & SL3_UFRAME_MASK,
+			    stream->start_frame & SL3_UFRAME_MASK);
+	else
+		snd_iprintf(buffer, "  %-15s uframe %u\n", name,
+			    stream->first_frame & SL3_UFRAME_MASK);
+}
+
 static void sl3_proc_read_status(struct snd_info_entry *entry,
 				 struct snd_info_buffer *buffer)
 {
@@ -25,9 +50,35 @@ static void sl3_proc_read_status(struct snd_info_entry *entry,
 	snd_iprintf(buffer, "  Deck C Routing: %s\n",
 		     route_names[dev->routing[2] & 1]);
 	snd_iprintf(buffer, "  Playback:       %s\n",
-		     dev->playback.running ? "running" : "stopped");
+		     sl3_proc_state(&dev->playback));
 	snd_iprintf(buffer, "  Capture:        %s\n",
-		     dev->capture.running ? "running" : "stopped");
+		     sl3_proc_state(&dev->capture));
+	snd_iprintf(buffer, "  Playback URBs:  %u x %u packets\n",
+		     dev->playback.num_urbs, dev->playback.num_packets);
+	snd_iprintf(buffer, "  Capture URBs:   %u x %u packets\n",
+		     dev->capture.num_urbs, dev->capture.num_packets);
+	snd_iprintf(buffer, "  In Flight:      playback %d/%u, capture %d/%u URBs\n",
+		     atomic_read(&dev->playback.urbs_inflight),
+		     dev->playback.num_urbs,
+		     atomic_read(&dev->capture.urbs_inflight),
+		     dev->capture.num_urbs);
+	snd_iprintf(buffer, "  URBs Recovered: playback %u, capture %u\n",
+		     dev->playback.urbs_recovered,
+		     dev->capture.urbs_recovered);
+	snd_iprintf(buffer, "  Stalls Cleared: playback %u, capture %u\n",
+		     dev->playback.halts_cleared,
+		     dev->capture.halts_cleared);
+	sl3_proc_print_start(buffer, "Playback Start:", &dev->playback);
+	sl3_proc_print_start(buffer, "Capture Start:", &dev->capture);
+	if (dev->playback.first_valid && dev->capture.first_valid)
+		snd_iprintf(buffer, "  Start Offset:   %u uframes (capture after playback)\n",
+			    (dev->capture.first_frame -
+			     dev->playback.first_frame) & SL3_UFRAME_MASK);
+	snd_iprintf(buffer, "  IRQ Coalescing: playback 1/%u, capture 1/%u URBs\n",
+		     dev->playback.coalesce, dev->capture.coalesce);
+	snd_iprintf(buffer, "  Zero-copy:      %s\n",
+		     dev->playback.zerocopy ? "active" :
+		     dev->zerocopy ? "enabled" : "off");
 	snd_iprintf(buffer, "  Disconnected:   %s\n",
 		     dev->disconnected ? "yes" : "no");
 }
@@ -76,16 +127,79 @@ static void sl3_proc_read_usb_port(struct snd_info_entry *entry,
 	snd_iprintf(buffer, "  Byte 3: 0x%02x\n", dev->usb_port_status[3]);
 }
 
+static void sl3_proc_print_copy(struct snd_info_buffer *buffer,
+				const char *name, struct sl3_stream *stream)
+{
+	u64 total, max, urbs;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	total = stream->copy_ns;
+	max = stream->copy_max_ns;
+	urbs = stream->copy_urbs;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	snd_iprintf(buffer, "  %s Copy: %llu URBs, avg %llu ns, max %llu ns\n",
+		     name, urbs, urbs ? div64_u64(total, urbs) : 0, max);
+}
+
+static void sl3_proc_print_continuity(struct snd_info_buffer *buffer,
+				      const char *name,
+				      struct sl3_stream *stream,
+				      bool is_capture)
+{
+	struct sl3_continuity c;
+	unsigned long flags;
+	u64 slips, slip_uframes;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	c = stream->continuity;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	slips = stream->slips;
+	slip_uframes = stream->slip_uframes;
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+
+	snd_iprintf(buffer, "  %s Schedule: %llu gaps (%llu uframes), %llu overlaps\n",
+		     name, c.uframe_gaps, c.missed_uframes, c.overlaps);
+	snd_iprintf(buffer, "  %s Slips: %llu URBs (%llu uframes)\n",
+		     name, slips, slip_uframes);
+	snd_iprintf(buffer, "  %s Packets: %llu missed by host, %llu bus errors",
+		     name, c.pkt_missed, c.pkt_errors);
+	if (is_capture)
+		snd_iprintf(buffer, ", %llu short, %llu empty",
+			     c.short_pkts, c.empty_pkts);
+	snd_iprintf(buffer, "\n");
+	if (is_capture)
+		snd_iprintf(buffer, "  %s Concealed: %llu packets, %llu frames\n",
+			     name, c.concealed_pkts, c.concealed_frames);
+}
+
+static void sl3_proc_print_stalls(struct snd_info_buffer *buffer,
+				  const char *name, struct sl3_stream *stream)
+{
+	u64 last, max;
+	unsigned int stalls;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	stalls = stream->stalls;
+	last = stream->stall_ns_last;
+	max = stream->stall_ns_max;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	snd_iprintf(buffer, "  %s Stalls: %u recovered, last %llu us, max %llu us\n",
+		     name, stalls, div_u64(last, NSEC_PER_USEC),
+		     div_u64(max, NSEC_PER_USEC));
+}
+
 static void sl3_proc_read_statistics(struct snd_info_entry *entry,
 				     struct snd_info_buffer *buffer)
 {
 	struct sl3_device *dev = entry->private_data;
-	unsigned int fb_samples;
-	unsigned long flags;
-
-	spin_lock_irqsave(&dev->feedback_lock, flags);
-	fb_samples = dev->feedback_samples;
-	spin_unlock_irqrestore(&dev->feedback_lock, flags);
+	int ppm, bus_ppm;
+	s64 mhz;
 
 	snd_iprintf(buffer, "Streaming Statistics\n");
 	snd_iprintf(buffer, "  Playback URBs Completed: %lld\n",
@@ -98,9 +212,27 @@ static void sl3_proc_read_statistics(struct snd_info_entry *entry,
 		     atomic_read(&dev->cap_overruns));
 	snd_iprintf(buffer, "  Discontinuities:         %d\n",
 		     atomic_read(&dev->discontinuities));
-	snd_iprintf(buffer, "  Implicit Feedback Samples: %u\n", fb_samples);
+	sl3_proc_print_continuity(buffer, "Playback", &dev->playback, false);
+	sl3_proc_print_continuity(buffer, "Capture ", &dev->capture, true);
+	sl3_proc_print_stalls(buffer, "Playback", &dev->playback);
+	sl3_proc_print_stalls(buffer, "Capture ", &dev->capture);
+	sl3_proc_print_copy(buffer, "Playback", &dev->playback);
+	sl3_proc_print_copy(buffer, "Capture ", &dev->capture);
+	snd_iprintf(buffer, "  Implicit Feedback Queued: %u packets\n",
+		     kfifo_len(&dev->feedback_fifo));
 	snd_iprintf(buffer, "  Nominal Rate:            %u Hz\n",
 		     dev->current_rate);
+
+	if (sl3_urb_rate_ppm(dev, &ppm, &bus_ppm)) {
+		/* Measured rate in mHz from the ppm offset */
+		mhz = div_s64((s64)dev->current_rate * (1000000 + ppm), 1000);
+		snd_iprintf(buffer, "  Measured Rate:           %lld.%03lld Hz\n",
+			     mhz / 1000, mhz % 1000);
+		snd_iprintf(buffer, "  Rate Ratio:              %+d ppm (monotonic), %+d ppm (USB bus)\n",
+			     ppm, bus_ppm);
+	} else {
+		snd_iprintf(buffer, "  Measured Rate:           n/a\n");
+	}
 }
 
 /* Create proc filesystem entries under /proc/asound/cardN/. */
@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-3.0
+/*
+ * Rane SL3 USB Audio Interface - ALSA Driver
+ *
+ * Sysfs attributes for per-device runtime tunables.  Files live in the
+ * audio control interface's directory, e.g.
+ * /sys/bus/usb/devices/<port>:1.0/urb_count
+ */
+
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/usb.h>
+
+#include "sl3.h"
+
+static struct sl3_device *sl3_sysfs_dev(struct device *d)
+{
+	return usb_get_intfdata(to_usb_interface(d));
+}
+
+/* Parse an unsigned value and check it against [min, max] */
+static int sl3_sysfs_parse(const char *buf, unsigned int min,
+			   unsigned int max, unsigned int *val)
+{
+	int err;
+
+	err = kstrtouint(buf, 0, val);
+	if (err)
+		return err;
+	if (*val < min || *val > max)
+		return -EINVAL;
+	return 0;
+}
+
+/* URB queue geometry: takes effect at the next stream prepare */
+
+static ssize_t urb_count_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%u\n", dev->urb_count);
+}
+
+static ssize_t urb_count_store(struct device *d,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	unsigned int val;
+	int err;
+
+	err = sl3_sysfs_parse(buf, SL3_MIN_URBS, SL3_MAX_URBS, &val);
+	if (err)
+		return err;
+
+	mutex_lock(&dev->stream_mutex);
+	dev->urb_count = val;
+	mutex_unlock(&dev->stream_mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(urb_count);
+
+static ssize_t urb_packets_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%u\n", dev->urb_packets);
+}
+
+static ssize_t urb_packets_store(struct device *d,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	unsigned int val;
+	int err;
+
+	err = sl3_sysfs_parse(buf, SL3_MIN_ISO_PACKETS, SL3_MAX_ISO_PACKETS,
+			      &val);
+	if (err)
+		return err;
+
+	mutex_lock(&dev->stream_mutex);
+	dev->urb_packets = val;
+	mutex_unlock(&dev->stream_mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(urb_packets);
+
+/* Low-latency playback: takes effect at the next playback open */
+
+static ssize_t lowlatency_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%d\n", dev->lowlatency);
+}
+
+static ssize_t lowlatency_store(struct device *d,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	bool val;
+	int err;
+
+	err = kstrtobool(buf, &val);
+	if (err)
+		return err;
+
+	mutex_lock(&dev->stream_mutex);
+	dev->lowlatency = val;
+	mutex_unlock(&dev->stream_mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(lowlatency);
+
+/* Interrupt coalescing: takes effect at the next stream prepare */
+
+static ssize_t coalesce_show(struct device *d,
+			     struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%d\n", dev->coalesce);
+}
+
+static ssize_t coalesce_store(struct device *d,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	bool val;
+	int err;
+
+	err = kstrtobool(buf, &val);
+	if (err)
+		return err;
+
+	mutex_lock(&dev->stream_mutex);
+	dev->coalesce = val;
+	mutex_unlock(&dev->stream_mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(coalesce);
+
+/* Per-stream xrun policy: takes effect immediately */
+
+static const char * const sl3_xrun_policies[] = {
+	[SL3_XRUN_STOP]		= "stop",
+	[SL3_XRUN_CONTINUE]	= "continue",
+};
+
+static ssize_t sl3_xrun_show(struct sl3_stream *stream, char *buf)
+{
+	return sysfs_emit(buf, "%s\n",
+			  sl3_xrun_policies[READ_ONCE(stream->xrun_policy)]);
+}
+
+static ssize_t sl3_xrun_store(struct sl3_stream *stream, const char *buf,
+			      size_t count)
+{
+	int i;
+
+	i = sysfs_match_string(sl3_xrun_policies, buf);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(stream->xrun_policy, i);
+	return count;
+}
+
+static ssize_t playback_xrun_show(struct device *d,
+				  struct device_attribute *attr, char *buf)
+{
+	return sl3_xrun_show(&sl3_sysfs_dev(d)->playback, buf);
+}
+
+static ssize_t playback_xrun_store(struct device *d,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	return sl3_xrun_store(&sl3_sysfs_dev(d)->playback, buf, count);
+}
+static DEVICE_ATTR_RW(playback_xrun);
+
+static ssize_t capture_xrun_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	return sl3_xrun_show(&sl3_sysfs_dev(d)->capture, buf);
+}
+
+static ssize_t capture_xrun_store(struct device *d,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	return sl3_xrun_store(&sl3_sysfs_dev(d)->capture, buf, count);
+}
+static DEVICE_ATTR_RW(capture_xrun);
+
+/* Per-stream converter latency reported in the delay: immediate */
+
+static ssize_t sl3_latency_show(struct sl3_stream *stream, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(stream->latency_us));
+}
+
+static ssize_t sl3_latency_store(struct sl3_stream *stream, const char *buf,
+				 size_t count)
+{
+	unsigned int val;
+	int err;
+
+	err = sl3_sysfs_parse(buf, 0, SL3_MAX_LATENCY_US, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(stream->latency_us, val);
+	return count;
+}
+
+static ssize_t playback_latency_us_show(struct device *d,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return sl3_latency_show(&sl3_sysfs_dev(d)->playback, buf);
+}
+
+static ssize_t playback_latency_us_store(struct device *d,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return sl3_latency_store(&sl3_sysfs_dev(d)->playback, buf, count);
+}
+static DEVICE_ATTR_RW(playback_latency_us);
+
+static ssize_t capture_latency_us_show(struct device *d,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	return sl3_latency_show(&sl3_sysfs_dev(d)->capture, buf);
+}
+
+static ssize_t capture_latency_us_store(struct device *d,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	return sl3_latency_store(&sl3_sysfs_dev(d)->capture, buf, count);
+}
+static DEVICE_ATTR_RW(capture_latency_us);
+
+/* Capture packet concealment: takes effect with the next URB */
+
+static const char * const sl3_conceal_modes[] = {
+	[SL3_CONCEAL_OFF]	= "off",
+	[SL3_CONCEAL_SILENCE]	= "silence",
+	[SL3_CONCEAL_REPEAT]	= "repeat",
+};
+
+static ssize_t conceal_show(struct device *d,
+			    struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%s\n",
+			  sl3_conceal_modes[READ_ONCE(dev->conceal)]);
+}
+
+static ssize_t conceal_store(struct device *d,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	int i;
+
+	i = sysfs_match_string(sl3_conceal_modes, buf);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(dev->conceal, i);
+	return count;
+}
+static DEVICE_ATTR_RW(conceal);
+
+/* Keepalive idle timeout: takes effect at the next close */
+
+static ssize_t keepalive_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->keepalive));
+}
+
+static ssize_t keepalive_store(struct device *d,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct sl3_device *dev = sl3_sysfs_dev(d);
+	unsigned int val;
+	int err;
+
+	err = sl3_sysfs_parse(buf, 0, SL3_MAX_KEEPALIVE, &val);
+	if (err)
+		return err;
+
+	WRITE_ONCE(dev->keepalive, val);
+	return count;
+}
+static DEVICE_ATTR_RW(keepalive);
+
+static struct attribute *sl3_attrs[] = {
+	&dev_attr_urb_count.attr,
+	&dev_attr_urb_packets.attr,
+	&dev_attr_lowlatency.attr,
+	&dev_attr_coalesce.attr,
+	&dev_attr_playback_xrun.attr,
+	&dev_attr_capture_xrun.attr,
+	&dev_attr_playback_latency_us.attr,
+	&dev_attr_capture_latency_us.attr,
+	&dev_attr_conceal.attr,
+	&dev_attr_keepalive.attr,
+	NULL,
+};
+
+static const struct attribute_group sl3_attr_group = {
+	.attrs = sl3_attrs,
+};
+
+/*
+ * Registered through the USB driver's dev_groups, so the driver core
+ * creates the attributes on the audio control interface before the
+ * bind uevent (udev rules can set them) and removes them before
+ * disconnect.  The other interfaces fail probe and never get them.
+ */
+const struct attribute_group *sl3_attr_groups[] = {
+	&sl3_attr_group,
+	NULL,
+};
@@ -9,12 +9,23 @@
 
 #include <linux/usb.h>
 #include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/math64.h>
+#include <linux/sched/clock.h>
+#include <linux/workqueue.h>
+#include <kunit/visibility.h>
 #include <sound/pcm.h>
 
 #include "sl3.h"
 
-/* Transfer buffer size per URB: 8 ISO packets x 126 bytes max */
-#define SL3_URB_BUFFER_SIZE	(SL3_ISO_PACKETS * SL3_MAX_PACKET_SIZE)
+/* Transfer buffer size per URB: N ISO packets x 126 bytes max */
+static inline unsigned int sl3_urb_buffer_size(struct sl3_stream *stream)
+{
+	return stream->num_packets * SL3_MAX_PACKET_SIZE;
+}
 
 /*
  * Packet sizing constants.
@@ -27,11 +38,30 @@
 #define SL3_SAMPLES_48K		6
 #define SL3_SAMPLES_44K_BASE	5
 #define SL3_FRAC_NUM		4100	/* 44100 - 5 * 8000 */
-#define SL3_FRAC_DENOM		8000	/* microframes per second */
+#define SL3_FRAC_DENOM		SL3_MICROFRAMES_PER_SEC
 
 static void sl3_playback_complete(struct urb *urb);
 static void sl3_capture_complete(struct urb *urb);
 
+/* Nominal samples for the next ISO packet, advancing fraction @acc */
+static unsigned int sl3_nominal_samples(struct sl3_device *dev,
+					unsigned int *acc)
+{
+	unsigned int samples;
+
+	if (dev->current_rate == 48000)
+		return SL3_SAMPLES_48K;
+
+	/* 44.1 kHz: base 5, add 1 when accumulator overflows */
+	samples = SL3_SAMPLES_44K_BASE;
+	*acc += SL3_FRAC_NUM;
+	if (*acc >= SL3_FRAC_DENOM) {
+		*acc -= SL3_FRAC_DENOM;
+		samples++;
+	}
+	return samples;
+}
+
 /*
  * Return samples for the next ISO packet and advance the fractional
  * accumulator.  Must be called with consistent serialization (either
@@ -39,145 +69,1482 @@ static void sl3_capture_complete(struct urb *urb);
  */
 static unsigned int sl3_next_packet_samples(struct sl3_device *dev)
 {
-	unsigned int samples;
+	return sl3_nominal_samples(dev, &dev->sample_accumulator);
+}
+
+/*
+ * The substream whose ring buffer a stream moves data for: none while
+ * the URBs only stream silence for keepalive or implicit feedback.
+ * Called under stream->lock.
+ */
+static struct snd_pcm_substream *sl3_stream_pcm(struct sl3_stream *stream)
+{
+	return stream->active ? stream->substream : NULL;
+}
+
+/* Point an URB back at its own bounce buffer */
+static void sl3_urb_use_bounce(struct sl3_urb_ctx *ctx)
+{
+	ctx->urb->transfer_buffer = ctx->buffer;
+	ctx->urb->transfer_dma = ctx->buffer_dma;
+}
+
+/*
+ * Submit an URB on the stream's anchor, counting it in flight.  The USB
+ * core unanchors it again when it is given back.  Once the stream's
+ * schedule is known the URB goes out on the microframe right after the
+ * previous one, so the host controller cannot quietly slide the stream
+ * to a later frame after a hiccup; if that frame is no longer possible
+ * the URB goes out as soon as possible.  An URB that did not get the
+ * frame it asked for, either way, counts as a slip.
+ * Completion interrupts follow the submission order too, since recovery
+ * and the low-latency ready list do not resubmit URBs in index order.
+ * A stream that is stopping or resetting takes no more URBs (-EPERM):
+ * checked under sched_lock, which sl3_urb_unlink_all() takes before it
+ * unlinks, so a completion cannot slip an URB in behind the cancel.
+ */
+static int sl3_submit_urb(struct sl3_stream *stream, struct urb *urb)
+{
+	unsigned long flags;
+	unsigned int slip;
+	bool explicit;
+	int err;
+
+	usb_anchor_urb(urb, &stream->anchor);
+	atomic_inc(&stream->urbs_inflight);
+
+	/* Frames are handed out in the order the URBs reach the HCD */
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	if (!READ_ONCE(stream->running) || stream->reset_pending) {
+		spin_unlock_irqrestore(&stream->sched_lock, flags);
+		err = -EPERM;
+		goto out;
+	}
+
+	if (++stream->submits % stream->coalesce)
+		urb->transfer_flags |= URB_NO_INTERRUPT;
+	else
+		urb->transfer_flags &= ~URB_NO_INTERRUPT;
+
+	explicit = stream->sched_valid;
+	if (explicit) {
+		urb->transfer_flags &= ~URB_ISO_ASAP;
+		urb->start_frame = stream->next_frame;
+	} else {
+		urb->transfer_flags |= URB_ISO_ASAP;
+	}
+
+	err = usb_submit_urb(urb, GFP_ATOMIC);
+	if (err && explicit && err != -ENODEV) {
+		urb->transfer_flags |= URB_ISO_ASAP;
+		err = usb_submit_urb(urb, GFP_ATOMIC);
+	}
+
+	/*
+	 * Some host controllers (xHCI) pick their own frame and accept the
+	 * URB anyway, so a slip is any URB not on the frame asked for.
+	 */
+	if (!err && explicit) {
+		slip = (urb->start_frame - stream->next_frame) &
+		       SL3_UFRAME_MASK;
+		if (slip) {
+			stream->slips++;
+			stream->slip_uframes += min(slip,
+						    SL3_UFRAME_MASK + 1 - slip);
+		}
+	}
+
+	/* The HCD reports the frame it scheduled an ASAP URB on */
+	if (!err) {
+		stream->next_frame = urb->start_frame + urb->number_of_packets;
+		stream->sched_valid = true;
+	} else {
+		stream->submits--;
+	}
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+
+out:
+	if (err) {
+		atomic_dec(&stream->urbs_inflight);
+		usb_unanchor_urb(urb);
+	}
+	return err;
+}
+
+/*
+ * Forget the schedule of a new stream, or one whose queue was
+ * cancelled: its next frame has passed, so the first URB of the new
+ * queue goes out ASAP and the host controller reports where.  Host
+ * controllers ignore the start frame of a queue that is not running
+ * anyway.
+ */
+static void sl3_stream_reschedule(struct sl3_stream *stream)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	stream->sched_valid = false;
+	stream->submits = 0;
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+}
+
+/**
+ * sl3_urb_frame_now - current USB microframe and its CLOCK_MONOTONIC time
+ * @dev: device
+ * @uframe: returns the microframe
+ * @ns: returns the time
+ *
+ * The USB core only reports the 1 ms frame number, so the microframe is
+ * taken as the middle of the current frame: within half a millisecond.
+ * Returns false if the host controller cannot say what frame it is on.
+ */
+bool sl3_urb_frame_now(struct sl3_device *dev, unsigned int *uframe, s64 *ns)
+{
+	int frame = usb_get_current_frame_number(dev->udev);
+
+	*ns = ktime_get_ns();
+	if (frame < 0)
+		return false;
+
+	*uframe = frame * 8 + 4;
+	return true;
+}
+
+/*
+ * Pick the microframe ring data starts on for all the streams one
+ * trigger starts: the @armed CLOCK_MONOTONIC time if set, else one far
+ * enough ahead for new queues to be running and their playback URBs
+ * filled for it, so the playback to capture offset is the same on
+ * every run.  An armed time too close to make starts as early as the
+ * queues allow.  Returns the estimated time of *@uframe, 0 if the host
+ * controller cannot say what frame it is on, or -ERANGE if @armed is
+ * further ahead than the frame counter can tell apart.
+ */
+static s64 sl3_urb_start_frame(struct sl3_device *dev, s64 armed,
+			       unsigned int *uframe)
+{
+	s64 now, ahead = SL3_START_LEAD_MS * NSEC_PER_MSEC;
+	unsigned int uframes;
+
+	if (!sl3_urb_frame_now(dev, uframe, &now))
+		return 0;
+
+	if (armed) {
+		if (armed - now > SL3_START_AT_MAX_MS * NSEC_PER_MSEC)
+			return -ERANGE;
+		ahead = max(armed - now, ahead);
+	}
+
+	uframes = div_s64(ahead + SL3_UFRAME_NS / 2, SL3_UFRAME_NS);
+	*uframe += uframes;
+	return now + (s64)uframes * SL3_UFRAME_NS;
+}
+
+/*
+ * A running playback queue has filled its URBs up to next_frame
+ * already, so its ring data cannot start before that: move the start
+ * at *@uframe (time *@ns) there if it is later.
+ */
+static void sl3_urb_start_after_queue(struct sl3_stream *stream,
+				      unsigned int *uframe, s64 *ns)
+{
+	unsigned long flags;
+	unsigned int ahead = 0;
+
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	if (stream->sched_valid)
+		ahead = (stream->next_frame - *uframe) & SL3_UFRAME_MASK;
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+
+	/* Half the counter range ahead is behind */
+	if (ahead && ahead <= SL3_UFRAME_MASK / 2) {
+		*uframe += ahead;
+		*ns += (s64)ahead * SL3_UFRAME_NS;
+	}
+}
+
+/*
+ * Start cancelling every queued URB of a stream without waiting, so the
+ * host controller retires them all in parallel.  URBs stay anchored
+ * until they are given back.  Safe in atomic context; callers clear
+ * running or set a reset bit first, and once sched_lock has been
+ * through here sl3_submit_urb() sees it.
+ */
+static void sl3_urb_unlink_all(struct sl3_stream *stream)
+{
+	unsigned long flags;
+	int i;
+
+	/* Wait out a submission that started before the stop */
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+
+	for (i = 0; i < stream->num_urbs; i++)
+		usb_unlink_urb(stream->urbs[i].urb);
+}
+
+/*
+ * Cancel a stream's queue and wait once for all of it, instead of one
+ * usb_kill_urb() round trip per URB.  Falls back to killing whatever
+ * is left if the host controller does not give the URBs back.
+ */
+static void sl3_urb_cancel(struct sl3_stream *stream)
+{
+	sl3_urb_unlink_all(stream);
+	if (!usb_wait_anchor_empty_timeout(&stream->anchor, SL3_URB_CANCEL_MS))
+		usb_kill_anchored_urbs(&stream->anchor);
+}
+
+/* Prepare a playback URB filled with silence (laid out before a start) */
+static void sl3_prepare_playback_urb(struct sl3_device *dev,
+				     struct sl3_urb_ctx *ctx)
+{
+	struct urb *urb = ctx->urb;
+	unsigned int offset = 0;
+	int i;
+
+	sl3_urb_use_bounce(ctx);
+	memset(ctx->buffer, 0, sl3_urb_buffer_size(&dev->playback));
+
+	for (i = 0; i < dev->playback.num_packets; i++) {
+		unsigned int samples = sl3_next_packet_samples(dev);
+		unsigned int bytes = samples * SL3_BYTES_PER_FRAME;
+
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = bytes;
+		offset += bytes;
+	}
+	urb->transfer_buffer_length = offset;
+	ctx->frames = offset / SL3_BYTES_PER_FRAME;
+	ctx->start_packet = -1;
+}
+
+/* Prepare a capture URB to receive data (max packet size per slot) */
+static void sl3_prepare_capture_urb(struct sl3_urb_ctx *ctx)
+{
+	struct urb *urb = ctx->urb;
+	unsigned int offset = 0;
+	int i;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = SL3_MAX_PACKET_SIZE;
+		offset += SL3_MAX_PACKET_SIZE;
+	}
+	urb->transfer_buffer_length = offset;
+}
+
+/*
+ * Set the ISO packet sizes of the next playback URB and record its total
+ * in ctx->frames.  Each playback packet takes the size of the next
+ * unconsumed capture packet, so playback follows the device clock
+ * packet for packet; the nominal rate is used when no feedback is
+ * queued.  Called under stream->lock.
+ */
+static void sl3_size_playback_urb(struct sl3_device *dev,
+				  struct sl3_urb_ctx *ctx)
+{
+	struct urb *urb = ctx->urb;
+	struct sl3_stream *stream = &dev->playback;
+	unsigned int offset = 0;
+	unsigned int frames = 0;
+	int i;
+
+	for (i = 0; i < stream->num_packets; i++) {
+		unsigned int samples;
+		unsigned int bytes;
+		u16 fb;
+
+		if (kfifo_get(&dev->feedback_fifo, &fb) && fb)
+			samples = min_t(unsigned int, fb,
+					SL3_MAX_PACKET_SIZE /
+					SL3_BYTES_PER_FRAME);
+		else
+			samples = sl3_next_packet_samples(dev);
+
+		bytes = samples * SL3_BYTES_PER_FRAME;
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = bytes;
+		offset += bytes;
+		frames += samples;
+	}
+	urb->transfer_buffer_length = offset;
+	ctx->frames = frames;
+}
+
+/*
+ * Account the CPU time of one URB copy started at @t0 (local_clock).
+ * Called under stream->lock.
+ */
+static void sl3_stream_account_copy(struct sl3_stream *stream, u64 t0)
+{
+	u64 ns = local_clock() - t0;
+
+	stream->copy_ns += ns;
+	stream->copy_urbs++;
+	if (ns > stream->copy_max_ns)
+		stream->copy_max_ns = ns;
+}
+
+/*
+ * Frames the driver has moved that the PCM core's hw_ptr has not caught
+ * up with yet.  Called under stream->lock.
+ */
+VISIBLE_IF_KUNIT snd_pcm_uframes_t
+sl3_stream_ahead(struct sl3_stream *stream, struct snd_pcm_runtime *runtime)
+{
+	snd_pcm_sframes_t ahead;
+
+	ahead = (snd_pcm_sframes_t)sl3_ring_pos(stream->hwptr, runtime) -
+		(snd_pcm_sframes_t)(runtime->status->hw_ptr %
+				    runtime->buffer_size);
+	if (ahead < 0)
+		ahead += runtime->buffer_size;
+
+	return ahead;
+}
+
+/*
+ * Frames the application has written that are not yet copied into an
+ * URB.  Called under stream->lock.
+ */
+VISIBLE_IF_KUNIT snd_pcm_sframes_t
+sl3_playback_queued(struct sl3_stream *stream, struct snd_pcm_runtime *runtime)
+{
+	return snd_pcm_playback_hw_avail(runtime) -
+	       sl3_stream_ahead(stream, runtime);
+}
+
+/**
+ * sl3_urb_playback_overlap - sent frames a rewind has taken back
+ * @stream: playback stream
+ * @runtime: its PCM runtime
+ *
+ * The PCM core bounds a rewind by the pointer it last read, and a
+ * completion may have committed more frames since.  Those have gone to
+ * the device and cannot be taken back; the pointer is held at appl_ptr
+ * until the application has written past them, so the core does not
+ * take hwptr passing appl_ptr for an underrun.  Returns the frames
+ * hwptr is past appl_ptr, 0 normally.  Called under stream->lock.
+ */
+snd_pcm_uframes_t sl3_urb_playback_overlap(struct sl3_stream *stream,
+					   struct snd_pcm_runtime *runtime)
+{
+	snd_pcm_sframes_t queued = sl3_playback_queued(stream, runtime);
+
+	return queued < 0 ? -queued : 0;
+}
+
+/*
+ * The application fell behind: count it once per episode and, under the
+ * stop policy, flag the PCM to be stopped with an xrun once
+ * stream->lock is dropped.  Free-running streams (stop_threshold at
+ * the boundary) asked never to be stopped.  Called under stream->lock.
+ */
+static void sl3_stream_xrun(struct sl3_stream *stream,
+			    struct snd_pcm_runtime *runtime, atomic_t *counter)
+{
+	if (!stream->in_xrun) {
+		stream->in_xrun = true;
+		atomic_inc(counter);
+	}
+
+	if (READ_ONCE(stream->xrun_policy) == SL3_XRUN_STOP &&
+	    runtime->stop_threshold < runtime->boundary)
+		stream->xrun_pending = true;
+}
+
+/* Take a pending xrun stop request.  Called under stream->lock. */
+static bool sl3_stream_take_xrun(struct sl3_stream *stream)
+{
+	bool xrun = stream->xrun_pending;
+
+	stream->xrun_pending = false;
+	return xrun;
+}
+
+/*
+ * Check that the application has written the *@frames the next playback
+ * URB needs.  If not, the URB is sent as silence rather than replaying
+ * stale ring data, and hwptr stays put until the data arrives.  So
+ * does a rewind into frames already sent (sl3_urb_playback_overlap()),
+ * without counting an underrun.  A
+ * draining stream sends what is left instead, cutting *@frames down to
+ * it, so hwptr reaches appl_ptr and the drain can finish.  Returns true
+ * if the URB is to be silence.  Called under stream->lock.
+ */
+VISIBLE_IF_KUNIT bool sl3_playback_underrun(struct sl3_device *dev,
+					    struct snd_pcm_substream *sub,
+					    unsigned int *frames)
+{
+	struct sl3_stream *stream = &dev->playback;
+	struct snd_pcm_runtime *runtime = sub->runtime;
+	snd_pcm_sframes_t queued;
+
+	queued = sl3_playback_queued(stream, runtime);
+	if (!snd_pcm_running(sub) || queued >= *frames) {
+		stream->in_xrun = false;
+		return false;
+	}
+
+	/* A rewind raced a completion: not the application's fault */
+	if (queued < 0)
+		return true;
+
+	if (runtime->status->state == SNDRV_PCM_STATE_DRAINING) {
+		*frames = max_t(snd_pcm_sframes_t, queued, 0);
+		return !*frames;
+	}
+
+	sl3_stream_xrun(stream, runtime, &dev->play_underruns);
+	return true;
+}
+
+/*
+ * Check that @frames of capture fit without overwriting frames the
+ * application has not read yet.  On overrun the URB's audio is dropped
+ * and hwptr stays put.  Returns true on overrun.  Called under
+ * stream->lock.
+ */
+VISIBLE_IF_KUNIT bool sl3_capture_overrun(struct sl3_device *dev,
+					  struct snd_pcm_substream *sub,
+					  unsigned int frames)
+{
+	struct sl3_stream *stream = &dev->capture;
+	struct snd_pcm_runtime *runtime = sub->runtime;
+	snd_pcm_uframes_t unread;
+
+	if (!snd_pcm_running(sub)) {
+		stream->in_xrun = false;
+		return false;
+	}
+
+	unread = snd_pcm_capture_avail(runtime) +
+		 sl3_stream_ahead(stream, runtime);
+	if (unread + frames <= runtime->buffer_size) {
+		stream->in_xrun = false;
+		return false;
+	}
+
+	sl3_stream_xrun(stream, runtime, &dev->cap_overruns);
+	return true;
+}
+
+/*
+ * Packets of an URB on microframe @uframe that come before the start
+ * of ring data: none once it has started or if no start frame is set,
+ * all @packets while the start frame is further on.  A start frame
+ * already passed starts at once.  Called under stream->lock.
+ */
+static unsigned int sl3_stream_start_skip(struct sl3_stream *stream,
+					  unsigned int uframe,
+					  unsigned int packets)
+{
+	unsigned int ahead;
+
+	if (!stream->start_pending || !stream->start_ns)
+		return 0;
+
+	/* Half the counter range ahead is behind */
+	ahead = (stream->start_frame - uframe) & SL3_UFRAME_MASK;
+	if (ahead > SL3_UFRAME_MASK / 2)
+		return 0;
+	return min(ahead, packets);
+}
+
+/*
+ * As above for a playback URB about to be filled.  It goes out on
+ * next_frame, straight after the URB before it; the first URB of a new
+ * queue goes wherever the host controller puts it, so it carries no
+ * ring data if a start frame is set.  Called under stream->lock.
+ */
+static unsigned int sl3_playback_start_skip(struct sl3_stream *stream,
+					    struct urb *urb)
+{
+	unsigned long flags;
+	unsigned int uframe;
+	bool valid;
+
+	if (!stream->start_pending || !stream->start_ns)
+		return 0;
+
+	spin_lock_irqsave(&stream->sched_lock, flags);
+	valid = stream->sched_valid;
+	uframe = stream->next_frame;
+	spin_unlock_irqrestore(&stream->sched_lock, flags);
+
+	if (!valid)
+		return urb->number_of_packets;
+	return sl3_stream_start_skip(stream, uframe, urb->number_of_packets);
+}
+
+/*
+ * A capture URB that failed as a whole delivered none of its packets:
+ * mark them all bad, so that concealment fills in their frames and the
+ * timeline does not slip by a whole URB.
+ */
+static void sl3_capture_urb_lost(struct urb *urb)
+{
+	int i;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		urb->iso_frame_desc[i].status = urb->status;
+		urb->iso_frame_desc[i].actual_length = 0;
+	}
+}
+
+/*
+ * Whole frames a capture packet delivered, and in *@pad the frames
+ * concealment adds for it: an errored packet is replaced by the nominal
+ * count, and a packet that lost the tail of its last frame is padded
+ * back to whole.  With concealment off both are dropped, as before.
+ * @acc is the 44.1 kHz fraction for replaced packets.
+ */
+static unsigned int sl3_capture_packet_frames(struct sl3_device *dev,
+		const struct usb_iso_packet_descriptor *desc,
+		enum sl3_conceal conceal, unsigned int *acc, unsigned int *pad)
+{
+	*pad = 0;
+
+	if (conceal == SL3_CONCEAL_OFF)
+		return desc->actual_length / SL3_BYTES_PER_FRAME;
+
+	if (desc->status) {
+		*pad = sl3_nominal_samples(dev, acc);
+		return 0;
+	}
+
+	if (desc->actual_length % SL3_BYTES_PER_FRAME)
+		*pad = 1;
+	return desc->actual_length / SL3_BYTES_PER_FRAME;
+}
+
+/*
+ * Write @frames concealment frames at ring offset *@pos: silence, or
+ * copies of the frame before them.  Frames never straddle the end of
+ * the ring.
+ */
+static void sl3_conceal_frames(u8 *ring, unsigned int buf_bytes,
+			       unsigned int *pos, unsigned int frames,
+			       bool repeat)
+{
+	unsigned int prev = (*pos ? *pos : buf_bytes) - SL3_BYTES_PER_FRAME;
+
+	while (frames--) {
+		if (repeat)
+			memcpy(ring + *pos, ring + prev, SL3_BYTES_PER_FRAME);
+		else
+			memset(ring + *pos, 0, SL3_BYTES_PER_FRAME);
+		prev = *pos;
+		*pos += SL3_BYTES_PER_FRAME;
+		if (*pos >= buf_bytes)
+			*pos -= buf_bytes;
+	}
+}
+
+/*
+ * Queue the received packet sizes as implicit feedback, then compact
+ * the packets, each in its own SL3_MAX_PACKET_SIZE slot of the URB
+ * buffer, into the ALSA ring buffer, concealing bad packets if enabled.
+ * Packets before the start of ring data only feed back.  hwptr
+ * advances once per URB.  Returns the frames received, whether or not
+ * an overrun or a pending start dropped them.  Called under
+ * stream->lock.
+ */
+static unsigned int sl3_copy_capture_urb(struct sl3_device *dev,
+					 struct sl3_urb_ctx *ctx)
+{
+	struct urb *urb = ctx->urb;
+	struct sl3_stream *stream = &dev->capture;
+	struct snd_pcm_substream *sub = sl3_stream_pcm(stream);
+	struct snd_pcm_runtime *runtime = sub ? sub->runtime : NULL;
+	enum sl3_conceal conceal = READ_ONCE(dev->conceal);
+	unsigned int acc = stream->conceal_acc;
+	unsigned int buf_bytes, pos, pad, skip, frames = 0, total = 0;
+	bool repeat;
+	u8 *ring;
+	u64 t0;
+	int i;
+
+	skip = runtime ? sl3_stream_start_skip(stream, urb->start_frame,
+					       urb->number_of_packets) : 0;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		struct usb_iso_packet_descriptor *desc = &urb->iso_frame_desc[i];
+		unsigned int samples;
+
+		if (i == skip)
+			acc = stream->conceal_acc;
+		samples = sl3_capture_packet_frames(dev, desc, conceal,
+						    &stream->conceal_acc, &pad);
+		if (pad) {
+			stream->continuity.concealed_pkts++;
+			stream->continuity.concealed_frames += pad;
+		}
+
+		/*
+		 * Queue implicit feedback for the playback side; errored
+		 * packets queue 0 so playback uses the nominal size unless
+		 * concealment already stood in for them.  A full FIFO
+		 * (playback idle) simply drops the entry.
+		 */
+		kfifo_put(&dev->feedback_fifo,
+			  desc->status && !pad ? 0 : (u16)(samples + pad));
+		total += samples + pad;
+		if (i >= skip)
+			frames += samples + pad;
+	}
+
+	if (!runtime || !runtime->dma_area || skip == urb->number_of_packets)
+		return total;
+
+	/* Ring data starts here, on the frame the packet came in on */
+	if (stream->start_pending) {
+		stream->start_pending = false;
+		stream->first_frame = urb->start_frame + skip;
+		stream->first_valid = true;
+	}
+
+	if (!frames || sl3_capture_overrun(dev, sub, frames))
+		return total;
+
+	t0 = local_clock();
+	ring = runtime->dma_area;
+	buf_bytes = snd_pcm_lib_buffer_bytes(sub);
+	pos = sl3_ring_pos(stream->hwptr, runtime) * SL3_BYTES_PER_FRAME;
+	/* Nothing to repeat before the first frame of the stream */
+	repeat = conceal == SL3_CONCEAL_REPEAT && stream->hwptr;
+
+	for (i = skip; i < urb->number_of_packets; i++) {
+		struct usb_iso_packet_descriptor *desc = &urb->iso_frame_desc[i];
+		unsigned int bytes;
+		const u8 *src = ctx->buffer + desc->offset;
+
+		/* Same answers as the first pass: replay the fraction */
+		bytes = sl3_capture_packet_frames(dev, desc, conceal, &acc,
+						  &pad) * SL3_BYTES_PER_FRAME;
+
+		if (bytes) {
+			/* A mirrored ring takes the overrun at its start */
+			if (stream->mirror || pos + bytes <= buf_bytes) {
+				memcpy(ring + pos, src, bytes);
+			} else {
+				unsigned int c1 = buf_bytes - pos;
+
+				memcpy(ring + pos, src, c1);
+				memcpy(ring, src + c1, bytes - c1);
+			}
+			pos += bytes;
+			if (pos >= buf_bytes)
+				pos -= buf_bytes;
+			repeat = conceal == SL3_CONCEAL_REPEAT;
+		}
+
+		if (pad) {
+			sl3_conceal_frames(ring, buf_bytes, &pos, pad, repeat);
+			repeat = conceal == SL3_CONCEAL_REPEAT;
+		}
+	}
+
+	stream->hwptr += frames;
+	stream->transfer_done += frames;
+	sl3_stream_account_copy(stream, t0);
+
+	return total;
+}
+
+/*
+ * Point a playback URB at the next ctx->frames of the ALSA ring buffer.
+ * In zero-copy mode the URB transfers straight from the DMA-coherent PCM
+ * buffer; URBs that would straddle the end of the ring, the first and
+ * last ones of a run, and all URBs in normal mode, are copied into the
+ * bounce buffer instead.  Packets before the start of ring data carry
+ * silence.  Called under stream->lock with the packets already sized.
+ */
+VISIBLE_IF_KUNIT void sl3_copy_playback_urb(struct sl3_device *dev,
+					    struct sl3_urb_ctx *ctx)
+{
+	struct urb *urb = ctx->urb;
+	struct sl3_stream *stream = &dev->playback;
+	struct snd_pcm_substream *sub = sl3_stream_pcm(stream);
+	struct snd_pcm_runtime *runtime = sub ? sub->runtime : NULL;
+	unsigned int hwptr_bytes, buf_bytes, frames, skip = 0, pre = 0;
+
+	ctx->start_packet = -1;
+	if (runtime && runtime->dma_area) {
+		skip = sl3_playback_start_skip(stream, urb);
+		if (skip < urb->number_of_packets)
+			pre = urb->iso_frame_desc[skip].offset;
+	}
+	frames = ctx->frames - pre / SL3_BYTES_PER_FRAME;
+
+	if (!runtime || !runtime->dma_area ||
+	    skip == urb->number_of_packets ||
+	    sl3_playback_underrun(dev, sub, &frames)) {
+		sl3_urb_use_bounce(ctx);
+		memset(ctx->buffer, 0, urb->transfer_buffer_length);
+		return;
+	}
+
+	/* Completion reports where ring data actually started */
+	if (stream->start_pending) {
+		stream->start_pending = false;
+		ctx->start_packet = skip;
+	}
+
+	buf_bytes = snd_pcm_lib_buffer_bytes(sub);
+	hwptr_bytes = sl3_ring_pos(stream->hwptr, runtime) *
+		      SL3_BYTES_PER_FRAME;
+
+	if (stream->zerocopy && !pre && frames == ctx->frames &&
+	    hwptr_bytes + urb->transfer_buffer_length <= buf_bytes) {
+		urb->transfer_buffer = runtime->dma_area + hwptr_bytes;
+		urb->transfer_dma = runtime->dma_addr + hwptr_bytes;
+	} else {
+		unsigned int bytes = frames * SL3_BYTES_PER_FRAME;
+		u64 t0 = local_clock();
+
+		/* Packets are contiguous in both the URB and the ring */
+		sl3_urb_use_bounce(ctx);
+		memset(ctx->buffer, 0, pre);
+		if (stream->mirror || hwptr_bytes + bytes <= buf_bytes) {
+			memcpy(ctx->buffer + pre,
+			       runtime->dma_area + hwptr_bytes, bytes);
+		} else {
+			unsigned int c1 = buf_bytes - hwptr_bytes;
+
+			memcpy(ctx->buffer + pre,
+			       runtime->dma_area + hwptr_bytes, c1);
+			memcpy(ctx->buffer + pre + c1, runtime->dma_area,
+			       bytes - c1);
+		}
+
+		/* End of a drain: silence after the last frame */
+		if (pre + bytes < urb->transfer_buffer_length)
+			memset(ctx->buffer + pre + bytes, 0,
+			       urb->transfer_buffer_length - pre - bytes);
+		sl3_stream_account_copy(stream, t0);
+	}
+
+	stream->hwptr += frames;
+	if (stream->zerocopy) {
+		/* Played, and free for the application, once it completes */
+		ctx->ring_frames = frames;
+		stream->ring_inflight += frames;
+	} else {
+		stream->transfer_done += frames;
+	}
+}
+
+/*
+ * Zero-copy: count the ring frames an URB carried as played once it is
+ * finished with, sent or not.  Called under stream->lock.
+ */
+static void sl3_playback_ring_done(struct sl3_stream *stream,
+				   struct sl3_urb_ctx *ctx)
+{
+	if (!ctx->ring_frames)
+		return;
+
+	stream->ring_inflight -= ctx->ring_frames;
+	stream->transfer_done += ctx->ring_frames;
+	ctx->ring_frames = 0;
+}
+
+/* Size and fill a playback URB in one go (normal, non-low-latency mode) */
+static void sl3_fill_playback_urb(struct sl3_device *dev,
+				  struct sl3_urb_ctx *ctx)
+{
+	sl3_size_playback_urb(dev, ctx);
+	sl3_copy_playback_urb(dev, ctx);
+}
+
+/*
+ * Fill the tail of a freshly laid out playback queue with audio the
+ * application wrote before START, so it plays after as little leading
+ * silence as the buffer allows instead of after a whole queue of it.
+ * One period stays in the ring buffer for the first completion, so the
+ * pointer cannot catch up with the application at once.  Called under
+ * stream->lock.
+ */
+static void sl3_prime_playback(struct sl3_device *dev)
+{
+	struct sl3_stream *stream = &dev->playback;
+	struct snd_pcm_substream *sub = sl3_stream_pcm(stream);
+	snd_pcm_sframes_t budget;
+	unsigned int first;
+
+	if (!sub || !sub->runtime->dma_area)
+		return;
+
+	budget = sl3_playback_queued(stream, sub->runtime) -
+		 sub->runtime->period_size;
+	for (first = stream->num_urbs; first > 0; first--) {
+		budget -= stream->urbs[first - 1].frames;
+		if (budget < 0)
+			break;
+	}
+
+	/* URBs go out in index order: silence first, then the audio */
+	for (; first < stream->num_urbs; first++)
+		sl3_copy_playback_urb(dev, &stream->urbs[first]);
+}
+
+/*
+ * Consume whole periods from transfer_done.  Returns true if the caller
+ * should signal snd_pcm_period_elapsed.  Called under stream->lock.
+ */
+static bool sl3_stream_period_elapsed(struct sl3_stream *stream)
+{
+	struct snd_pcm_substream *sub = sl3_stream_pcm(stream);
+	bool elapsed, draining;
+
+	if (!sub || !sub->runtime)
+		return false;
+
+	/*
+	 * The core only notices the end of a drain when the pointer is
+	 * updated, and the last period of one is usually partial.
+	 */
+	draining = sub->runtime->status->state == SNDRV_PCM_STATE_DRAINING;
+	elapsed = draining;
+
+	/* Timer-driven clients poll the pointer instead */
+	if (sub->runtime->no_period_wakeup) {
+		stream->transfer_done %= sub->runtime->period_size;
+		return draining;
+	}
+
+	while (stream->transfer_done >= sub->runtime->period_size) {
+		stream->transfer_done -= sub->runtime->period_size;
+		elapsed = true;
+	}
+	return elapsed;
+}
+
+/*
+ * Check a completed URB's start_frame against the end of the previous
+ * one and its packets' status, so a glitch can be traced to its source:
+ * gaps and overlaps in the schedule and -EXDEV packets point at the
+ * host controller, other packet errors at the bus, and short or empty
+ * capture packets at the device.  Schedule breaks also count as
+ * discontinuities.  Called under stream->lock before
+ * sl3_stream_mark_complete().
+ */
+static void sl3_stream_check_continuity(struct sl3_device *dev,
+					struct sl3_stream *stream,
+					struct urb *urb)
+{
+	struct sl3_continuity *c = &stream->continuity;
+	bool is_capture = (stream == &dev->capture);
+	unsigned int gap, min_bytes;
+	int i;
+
+	/* Lost audio would bias the clock estimate: start it afresh */
+	if (is_capture && urb->status)
+		dev->rate_started = false;
+
+	if (stream->link_valid) {
+		gap = (urb->start_frame - stream->link_frame) & SL3_UFRAME_MASK;
+		if (gap) {
+			if (is_capture)
+				dev->rate_started = false;
+			/* Half the counter range back is a late restart */
+			if (gap <= SL3_UFRAME_MASK / 2) {
+				c->uframe_gaps++;
+				c->missed_uframes += gap;
+			} else {
+				c->overlaps++;
+			}
+			atomic_inc(&dev->discontinuities);
+		}
+	}
+
+	/* The device varies packets by one frame to follow its clock */
+	min_bytes = (dev->current_rate / SL3_MICROFRAMES_PER_SEC - 1) *
+		    SL3_BYTES_PER_FRAME;
+
+	for (i = 0; i < urb->number_of_packets; i++) {
+		struct usb_iso_packet_descriptor *desc = &urb->iso_frame_desc[i];
+
+		switch (desc->status) {
+		case 0:
+			break;
+		case -EXDEV:
+			c->pkt_missed++;
+			continue;
+		default:
+			c->pkt_errors++;
+			continue;
+		}
+
+		if (!is_capture)
+			continue;
+		if (!desc->actual_length)
+			c->empty_pkts++;
+		else if (desc->actual_length < min_bytes)
+			c->short_pkts++;
+	}
+}
+
+/*
+ * Record an URB completion for the delay estimate and link timestamps.
+ * @frames is the number of frames the completed URB moved; up to
+ * ptr_step frames go over the bus before the next batch of completions.
+ * Called under stream->lock, before the URB can be resubmitted and its
+ * start_frame overwritten.
+ */
+static void sl3_stream_mark_complete(struct sl3_stream *stream,
+				     struct urb *urb, unsigned int frames)
+{
+	struct sl3_urb_ctx *ctx = urb->context;
+	unsigned int end = urb->start_frame + urb->number_of_packets;
+
+	/* Playback ring data started in this URB: where it went out */
+	if (ctx->start_packet >= 0) {
+		stream->first_frame = urb->start_frame + ctx->start_packet;
+		stream->first_valid = true;
+		ctx->start_packet = -1;
+	}
+
+	/* Bus time since stream start, in microframes */
+	if (stream->link_valid)
+		stream->link_uframes += (end - stream->link_frame) &
+					SL3_UFRAME_MASK;
+	else
+		stream->link_uframes = urb->number_of_packets;
+	stream->link_frame = end;
+	stream->link_valid = true;
+
+	/*
+	 * Coalesced URBs complete in a batch with the interrupting one on
+	 * EHCI, but one by one on xHCI, which ignores URB_NO_INTERRUPT:
+	 * every completion moves the position, so every one is the base.
+	 */
+	stream->ptr_step = frames * stream->coalesce;
+	stream->last_complete = ktime_get();
+}
+
+/*
+ * Offset of @frames from the nominal @rate over @span, where @span is
+ * measured in units of 1/@unit second, in ppm.  Both products stay well
+ * inside 64 bits for a SL3_RATE_WINDOW_NS window.
+ */
+static int sl3_rate_offset_ppm(u64 frames, u64 span, unsigned int rate,
+			       unsigned int unit)
+{
+	s64 actual = frames * unit;
+	s64 expected = span * rate;
+	s64 ppm;
+
+	if (expected < 1000000)
+		return 0;
+	ppm = div64_s64(actual - expected, div64_s64(expected, 1000000));
+	return clamp_t(s64, ppm, -SL3_RATE_PPM_LIMIT, SL3_RATE_PPM_LIMIT);
+}
+
+/*
+ * Feed one capture URB (@frames received over @uframes bus microframes)
+ * into the device clock estimate.  Frames are compared against
+ * CLOCK_MONOTONIC since rate_start, so completion jitter averages out
+ * as the span grows.  Past SL3_RATE_WINDOW_NS the counts are halved and
+ * rate_start moved forward to match, so old history fades and slow
+ * drift is still tracked.  Audio lost to failed URBs, schedule gaps or
+ * stream resets clears rate_started, so the estimate starts again from
+ * the next completion; the last value is reported meanwhile.  Called
+ * under capture.lock.
+ */
+static void sl3_rate_update(struct sl3_device *dev, unsigned int frames,
+			    unsigned int uframes)
+{
+	ktime_t now = ktime_get();
+	s64 elapsed;
+
+	if (!dev->rate_started) {
+		/* Anchor on this completion; its frames precede the anchor */
+		dev->rate_start = now;
+		dev->rate_frames = 0;
+		dev->rate_uframes = 0;
+		dev->rate_started = true;
+		return;
+	}
+
+	dev->rate_frames += frames;
+	dev->rate_uframes += uframes;
+
+	elapsed = ktime_to_ns(ktime_sub(now, dev->rate_start));
+	if (elapsed < SL3_RATE_MIN_NS)
+		return;
+
+	dev->rate_ppm = sl3_rate_offset_ppm(dev->rate_frames, elapsed,
+					    dev->current_rate, NSEC_PER_SEC);
+	dev->rate_bus_ppm = sl3_rate_offset_ppm(dev->rate_frames,
+						dev->rate_uframes,
+						dev->current_rate,
+						SL3_MICROFRAMES_PER_SEC);
+	dev->rate_valid = true;
+
+	if (elapsed > SL3_RATE_WINDOW_NS) {
+		dev->rate_frames /= 2;
+		dev->rate_uframes /= 2;
+		dev->rate_start = ktime_add_ns(dev->rate_start, elapsed / 2);
+	}
+}
+
+/**
+ * sl3_urb_rate_ppm - current device clock estimate
+ * @dev: device
+ * @ppm: returns the offset from the nominal rate against CLOCK_MONOTONIC
+ * @bus_ppm: returns the offset from the nominal rate against the USB bus
+ *
+ * Return: true once capture has run for at least SL3_RATE_MIN_NS.
+ */
+bool sl3_urb_rate_ppm(struct sl3_device *dev, int *ppm, int *bus_ppm)
+{
+	unsigned long flags;
+	bool valid;
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	valid = dev->rate_valid;
+	*ppm = valid ? dev->rate_ppm : 0;
+	*bus_ppm = valid ? dev->rate_bus_ppm : 0;
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+
+	return valid;
+}
+
+/*
+ * Interrupt coalescing: only every Nth URB raises a completion interrupt,
+ * and the host controller reports the N-1 URBs before it in the same
+ * interrupt, so their handlers run back to back as one batch.  N is the
+ * number of whole URBs per period, so period boundaries are still
+ * signalled within a period, and at most half the queue so resubmission
+ * keeps well ahead of the bus.  Low-latency playback keeps too few URBs
+ * in flight to coalesce.  Only EHCI honours URB_NO_INTERRUPT; xHCI
+ * still interrupts for every URB.
+ */
+static unsigned int sl3_coalesce_urbs(struct sl3_device *dev,
+				      struct sl3_stream *stream)
+{
+	struct snd_pcm_substream *sub = stream->substream;
+	unsigned int urb_frames, n;
+
+	/* Implicit capture runs at the pace of the playback stream */
+	if (!sub)
+		sub = dev->playback.substream;
+
+	if (!dev->coalesce || !sub || stream->lowlatency)
+		return 1;
+
+	urb_frames = stream->num_packets * dev->current_rate /
+		     SL3_MICROFRAMES_PER_SEC;
+	n = sub->runtime->period_size / max(urb_frames, 1U);
+	return clamp(n, 1U, max(stream->num_urbs / 2, 1U));
+}
+
+/*
+ * Low-latency playback: fill idle URBs from the ring buffer and submit
+ * them only once the application has written enough frames, keeping at
+ * most stream->max_inflight URBs queued to the device.  If the queue
+ * would otherwise run dry one URB is sent regardless, so the device
+ * clock and the period interrupts keep running.  Called under
+ * stream->lock.
+ */
+static void __sl3_queue_pending_playback(struct sl3_device *dev)
+{
+	struct sl3_stream *stream = &dev->playback;
+	struct snd_pcm_substream *sub = sl3_stream_pcm(stream);
+	struct sl3_urb_ctx *ctx;
+	int err;
+
+	while (stream->running && !dev->disconnected &&
+	       !stream->reset_pending &&
+	       !list_empty(&stream->ready_list) &&
+	       atomic_read(&stream->urbs_inflight) < stream->max_inflight) {
+		ctx = list_first_entry(&stream->ready_list,
+				       struct sl3_urb_ctx, ready_list);
+
+		/* Size once; the packet pattern must not be re-rolled */
+		if (!ctx->sized) {
+			sl3_size_playback_urb(dev, ctx);
+			ctx->sized = true;
+		}
+
+		/* A drain sends its tail at once */
+		if (sub && sub->runtime &&
+		    sub->runtime->status->state != SNDRV_PCM_STATE_DRAINING &&
+		    atomic_read(&stream->urbs_inflight) > 0 &&
+		    sl3_playback_queued(stream, sub->runtime) < ctx->frames)
+			break;
+
+		list_del_init(&ctx->ready_list);
+		sl3_copy_playback_urb(dev, ctx);
+		ctx->sized = false;
+
+		err = sl3_submit_urb(stream, ctx->urb);
+		if (err) {
+			list_add_tail(&ctx->ready_list, &stream->ready_list);
+			if (err != -ENODEV && err != -ENOENT && err != -EPERM)
+				dev_err_ratelimited(&dev->intf->dev,
+						    "playback URB[%d] submit: %d\n",
+						    ctx->index, err);
+			break;
+		}
+	}
+}
+
+/*
+ * As above, taking stream->lock; returns true if a period elapsed and
+ * sets *xrun if the PCM should be stopped with an xrun.
+ */
+static bool sl3_queue_pending_playback(struct sl3_device *dev, bool *xrun)
+{
+	struct sl3_stream *stream = &dev->playback;
+	unsigned long flags;
+	bool do_elapsed;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	__sl3_queue_pending_playback(dev);
+	do_elapsed = sl3_stream_period_elapsed(stream);
+	*xrun = sl3_stream_take_xrun(stream);
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	return do_elapsed;
+}
+
+/* In-flight cap for low-latency playback: about one period of URBs */
+static unsigned int sl3_lowlatency_max_inflight(struct sl3_stream *stream)
+{
+	struct snd_pcm_runtime *runtime;
+	unsigned int urb_frames;
+
+	if (!stream->substream || !stream->substream->runtime)
+		return stream->num_urbs;
+
+	runtime = stream->substream->runtime;
+	urb_frames = DIV_ROUND_UP(stream->num_packets * runtime->rate,
+				  SL3_MICROFRAMES_PER_SEC);
+
+	return clamp_t(unsigned int,
+		       DIV_ROUND_UP(runtime->period_size, urb_frames),
+		       2, stream->num_urbs);
+}
+
+/*
+ * PCM .ack for playback: in low-latency mode, push freshly written
+ * frames into the next outgoing URB.  Called with the PCM stream lock
+ * held.
+ */
+int sl3_urb_playback_ack(struct sl3_device *dev)
+{
+	struct sl3_stream *stream = &dev->playback;
+	bool xrun;
+
+	if (!stream->lowlatency || !stream->running)
+		return 0;
+
+	if (sl3_queue_pending_playback(dev, &xrun))
+		snd_pcm_period_elapsed_under_stream_lock(stream->substream);
+
+	/* .ack runs under the PCM stream lock */
+	if (xrun)
+		snd_pcm_stop(stream->substream, SNDRV_PCM_STATE_XRUN);
+
+	return 0;
+}
+
+/*
+ * Retire an URB that kept failing or could not be resubmitted.  It is
+ * re-prepared and resubmitted from process context shortly after, so
+ * the queue does not slowly drain over a long session.
+ */
+static void sl3_urb_mark_dead(struct sl3_stream *stream,
+			      struct sl3_urb_ctx *ctx)
+{
+	set_bit(ctx->index, stream->dead_urbs);
+	schedule_delayed_work(&stream->recover_work,
+			      msecs_to_jiffies(SL3_URB_RECOVER_MS));
+}
+
+/*
+ * Ask the recovery worker to reset the stream (SL3_RESET_* @reason).
+ * Submissions stop at once; clearing a halt and killing URBs sleep, so
+ * neither can be done from completion or timer context.
+ */
+static void sl3_urb_request_reset(struct sl3_stream *stream, int reason)
+{
+	set_bit(reason, &stream->reset_pending);
+	mod_delayed_work(system_wq, &stream->recover_work, 0);
+}
+
+/*
+ * Reset a stream in place: kill the URBs still queued, retire every URB
+ * not parked on the low-latency ready list and clear the endpoint halt
+ * if there was one, so the dead URBs are re-primed and resubmitted as
+ * soon as possible.  Completions and low-latency submission leave URBs alone until the
+ * reset bits are cleared.  Returns true if the watchdog asked for it.
+ */
+static bool sl3_urb_reset(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	bool is_playback = (stream == &dev->playback);
+	unsigned long flags;
+	int i, err;
+
+	sl3_urb_cancel(stream);
+	sl3_stream_reschedule(stream);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	/* The audio lost over the reset would bias the clock estimate */
+	if (!is_playback)
+		dev->rate_started = false;
+	for (i = 0; i < stream->num_urbs; i++) {
+		if (is_playback && stream->lowlatency &&
+		    !list_empty(&stream->urbs[i].ready_list))
+			continue;
+		set_bit(i, stream->dead_urbs);
+	}
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	if (test_and_clear_bit(SL3_RESET_HALT, &stream->reset_pending)) {
+		err = usb_clear_halt(dev->udev, stream->pipe);
+		if (err)
+			dev_warn(&dev->intf->dev, "%s clear halt failed: %d\n",
+				 is_playback ? "playback" : "capture", err);
+		else
+			stream->halts_cleared++;
+	}
+
+	return test_and_clear_bit(SL3_RESET_STALL, &stream->reset_pending);
+}
+
+/* Record a stall recovery, timed from the last completion seen */
+static void sl3_stream_account_stall(struct sl3_stream *stream)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), stream->stall_start));
+
+	stream->stalls++;
+	stream->stall_ns_last = ns;
+	stream->stall_ns_max = max(stream->stall_ns_max, ns);
+}
+
+/*
+ * Re-prepare and resubmit the dead URBs of a running stream.  Playback
+ * URBs are refilled from the ring buffer (or parked on the ready list
+ * in low-latency mode), so the stream carries on where it is.  If a
+ * resubmit still fails the rest are retried after another delay.
+ */
+static void sl3_urb_recover(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	bool is_playback = (stream == &dev->playback);
+	struct snd_pcm_substream *sub;
+	unsigned long flags;
+	bool stalled = false;
+	bool retry = false;
+	bool xrun = false;
+	int i, err = 0;
+
+	if (READ_ONCE(stream->reset_pending) && stream->running &&
+	    !dev->disconnected)
+		stalled = sl3_urb_reset(dev, stream);
+
+	spin_lock_irqsave(&stream->lock, flags);
+
+	sub = stream->substream;
+	for_each_set_bit(i, stream->dead_urbs, stream->num_urbs) {
+		struct sl3_urb_ctx *ctx = &stream->urbs[i];
+
+		/* Reset again: the worker has been requeued */
+		if (!stream->running || dev->disconnected ||
+		    stream->reset_pending)
+			break;
+
+		clear_bit(i, stream->dead_urbs);
+		ctx->error_retries = 0;
+		stream->urbs_recovered++;
+		if (is_playback)
+			sl3_playback_ring_done(stream, ctx);
 
-	if (dev->current_rate == 48000)
-		return SL3_SAMPLES_48K;
+		if (is_playback && stream->lowlatency) {
+			list_add_tail(&ctx->ready_list, &stream->ready_list);
+			continue;
+		}
 
-	/* 44.1 kHz: base 5, add 1 when accumulator overflows */
-	samples = SL3_SAMPLES_44K_BASE;
-	dev->sample_accumulator += SL3_FRAC_NUM;
-	if (dev->sample_accumulator >= SL3_FRAC_DENOM) {
-		dev->sample_accumulator -= SL3_FRAC_DENOM;
-		samples++;
+		if (is_playback)
+			sl3_fill_playback_urb(dev, ctx);
+		else if (!is_playback)
+			sl3_prepare_capture_urb(ctx);
+
+		err = sl3_submit_urb(stream, ctx->urb);
+		if (err) {
+			stream->urbs_recovered--;
+			set_bit(i, stream->dead_urbs);
+			retry = (err != -ENODEV && err != -EPERM);
+			break;
+		}
 	}
-	return samples;
-}
 
-/* Prepare a playback URB filled with silence (used for initial submission) */
-static void sl3_prepare_playback_urb(struct sl3_device *dev,
-				     struct sl3_urb_ctx *ctx)
-{
-	struct urb *urb = ctx->urb;
-	unsigned int offset = 0;
-	int i;
+	if (is_playback && stream->lowlatency)
+		__sl3_queue_pending_playback(dev);
+	if (is_playback)
+		xrun = sl3_stream_take_xrun(stream);
+	if (stalled)
+		sl3_stream_account_stall(stream);
 
-	memset(ctx->buffer, 0, SL3_URB_BUFFER_SIZE);
+	spin_unlock_irqrestore(&stream->lock, flags);
 
-	for (i = 0; i < SL3_ISO_PACKETS; i++) {
-		unsigned int samples = sl3_next_packet_samples(dev);
-		unsigned int bytes = samples * SL3_BYTES_PER_FRAME;
+	if (xrun && sub)
+		snd_pcm_stop_xrun(sub);
 
-		urb->iso_frame_desc[i].offset = offset;
-		urb->iso_frame_desc[i].length = bytes;
-		offset += bytes;
+	if (retry) {
+		dev_warn_ratelimited(&dev->intf->dev,
+				     "%s URB recovery: %d, retrying\n",
+				     is_playback ? "playback" : "capture", err);
+		schedule_delayed_work(&stream->recover_work,
+				      msecs_to_jiffies(SL3_URB_RECOVER_MS));
 	}
-	urb->transfer_buffer_length = offset;
 }
 
-/* Prepare a capture URB to receive data (max packet size per slot) */
-static void sl3_prepare_capture_urb(struct sl3_urb_ctx *ctx)
+/*
+ * Completion watchdog.  If no completion callback has run for
+ * wd_timeout_ns while URBs are queued, the host controller has stopped
+ * delivering them: have the recovery worker restart the queue in place.
+ * Streams already resetting, or with every URB retired, are left to
+ * the worker.
+ */
+static enum hrtimer_restart sl3_watchdog_fn(struct hrtimer *timer)
 {
-	struct urb *urb = ctx->urb;
-	unsigned int offset = 0;
-	int i;
-
-	for (i = 0; i < SL3_ISO_PACKETS; i++) {
-		urb->iso_frame_desc[i].offset = offset;
-		urb->iso_frame_desc[i].length = SL3_MAX_PACKET_SIZE;
-		offset += SL3_MAX_PACKET_SIZE;
+	struct sl3_stream *stream = container_of(timer, struct sl3_stream,
+						 watchdog);
+	unsigned int n = atomic_read(&stream->completions);
+	ktime_t now = ktime_get();
+
+	if (!READ_ONCE(stream->running))
+		return HRTIMER_NORESTART;
+
+	if (n != stream->wd_completions || READ_ONCE(stream->reset_pending) ||
+	    !atomic_read(&stream->urbs_inflight)) {
+		stream->wd_completions = n;
+		stream->wd_progress = now;
+	} else if (ktime_to_ns(ktime_sub(now, stream->wd_progress)) >=
+		   stream->wd_timeout_ns) {
+		stream->stall_start = stream->wd_progress;
+		sl3_urb_request_reset(stream, SL3_RESET_STALL);
 	}
-	urb->transfer_buffer_length = offset;
+
+	hrtimer_forward_now(timer, ns_to_ktime(stream->wd_timeout_ns));
+	return HRTIMER_RESTART;
 }
 
 /*
- * Copy audio from the ALSA playback ring buffer into an URB and set
- * ISO packet descriptors.  Called under stream->lock from the
- * completion callback.
+ * Arm the watchdog for a started stream.  The timeout is four
+ * completion interrupt intervals, so coalescing is allowed for, but no
+ * less than SL3_WATCHDOG_MIN_MS so scheduling jitter is not taken for a
+ * stall.  The timer checks once per timeout, so a stall is caught
+ * within two timeouts without waking the CPU more often than the
+ * completions it is watching.
  */
-static void sl3_fill_playback_urb(struct sl3_device *dev,
-				  struct sl3_urb_ctx *ctx)
+static void sl3_watchdog_start(struct sl3_stream *stream)
 {
-	struct urb *urb = ctx->urb;
-	struct sl3_stream *stream = &dev->playback;
-	struct snd_pcm_substream *sub = stream->substream;
-	struct snd_pcm_runtime *runtime = sub ? sub->runtime : NULL;
-	unsigned int feedback_total;
-	unsigned int offset = 0;
-	int i;
-
-	/* Read the implicit feedback sample count (IRQs already disabled) */
-	spin_lock(&dev->feedback_lock);
-	feedback_total = dev->feedback_samples;
-	spin_unlock(&dev->feedback_lock);
-
-	for (i = 0; i < SL3_ISO_PACKETS; i++) {
-		unsigned int samples;
-		unsigned int bytes;
+	u64 irq_ns = (u64)stream->coalesce * stream->num_packets *
+		     (NSEC_PER_SEC / SL3_MICROFRAMES_PER_SEC);
+
+	stream->wd_timeout_ns = max_t(u64, 4 * irq_ns,
+				      SL3_WATCHDOG_MIN_MS * NSEC_PER_MSEC);
+	stream->wd_completions = atomic_read(&stream->completions);
+	stream->wd_progress = ktime_get();
+	hrtimer_start(&stream->watchdog, ns_to_ktime(stream->wd_timeout_ns),
+		      HRTIMER_MODE_REL);
+}
 
-		if (dev->capture.running && feedback_total > 0) {
-			/* Distribute feedback evenly across remaining packets */
-			unsigned int remaining = SL3_ISO_PACKETS - i;
+static void sl3_playback_recover_work(struct work_struct *work)
+{
+	struct sl3_device *dev = container_of(to_delayed_work(work),
+					      struct sl3_device,
+					      playback.recover_work);
 
-			samples = (feedback_total + remaining - 1) / remaining;
-			if (samples > SL3_MAX_PACKET_SIZE / SL3_BYTES_PER_FRAME)
-				samples = SL3_MAX_PACKET_SIZE /
-					  SL3_BYTES_PER_FRAME;
-			feedback_total -= samples;
-		} else {
-			samples = sl3_next_packet_samples(dev);
-		}
+	sl3_urb_recover(dev, &dev->playback);
+}
 
-		bytes = samples * SL3_BYTES_PER_FRAME;
-		urb->iso_frame_desc[i].offset = offset;
-		urb->iso_frame_desc[i].length = bytes;
+static void sl3_capture_recover_work(struct work_struct *work)
+{
+	struct sl3_device *dev = container_of(to_delayed_work(work),
+					      struct sl3_device,
+					      capture.recover_work);
 
-		if (runtime && runtime->dma_area) {
-			unsigned int buf_size = runtime->buffer_size;
-			unsigned int hwptr = stream->hwptr % buf_size;
-			unsigned int hwptr_bytes = hwptr * SL3_BYTES_PER_FRAME;
-			unsigned int buf_bytes =
-				snd_pcm_lib_buffer_bytes(sub);
-
-			if (hwptr_bytes + bytes <= buf_bytes) {
-				memcpy(ctx->buffer + offset,
-				       runtime->dma_area + hwptr_bytes,
-				       bytes);
-			} else {
-				unsigned int c1 = buf_bytes - hwptr_bytes;
+	sl3_urb_recover(dev, &dev->capture);
+}
 
-				memcpy(ctx->buffer + offset,
-				       runtime->dma_area + hwptr_bytes, c1);
-				memcpy(ctx->buffer + offset + c1,
-				       runtime->dma_area, bytes - c1);
-			}
-			stream->hwptr += samples;
-			stream->transfer_done += samples;
-		} else {
-			memset(ctx->buffer + offset, 0, bytes);
-		}
+/*
+ * Nothing is open any more: stop keepalive streaming once the idle
+ * timeout passes without a new open.
+ */
+void sl3_urb_keepalive_idle(struct sl3_device *dev)
+{
+	if (dev->playback.running || dev->capture.running)
+		mod_delayed_work(system_wq, &dev->keepalive_work,
+				 READ_ONCE(dev->keepalive) * HZ);
+}
 
-		offset += bytes;
+static void sl3_keepalive_work(struct work_struct *work)
+{
+	struct sl3_device *dev = container_of(to_delayed_work(work),
+					      struct sl3_device,
+					      keepalive_work);
+
+	/* Prepare takes stream_mutex, so no START can race with this */
+	mutex_lock(&dev->stream_mutex);
+	if (!dev->playback.substream && !dev->capture.substream) {
+		sl3_urb_stop(dev, &dev->playback);
+		sl3_urb_stop(dev, &dev->capture);
 	}
-	urb->transfer_buffer_length = offset;
+	mutex_unlock(&dev->stream_mutex);
 }
 
-/* Allocate isochronous URBs and DMA buffers for a stream. */
+/* Set up per-stream URB state that outlives URB reallocation. */
+void sl3_urb_init(struct sl3_device *dev)
+{
+	INIT_DELAYED_WORK(&dev->keepalive_work, sl3_keepalive_work);
+	init_usb_anchor(&dev->playback.anchor);
+	init_usb_anchor(&dev->capture.anchor);
+	INIT_DELAYED_WORK(&dev->playback.recover_work,
+			  sl3_playback_recover_work);
+	INIT_DELAYED_WORK(&dev->capture.recover_work,
+			  sl3_capture_recover_work);
+	hrtimer_setup(&dev->playback.watchdog, sl3_watchdog_fn,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_setup(&dev->capture.watchdog, sl3_watchdog_fn,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+}
+
+/*
+ * Allocate isochronous URBs and DMA buffers for a stream, using the
+ * URB count and packets-per-URB currently requested for the device.
+ */
 int sl3_urb_alloc(struct sl3_device *dev, struct sl3_stream *stream, int pipe)
 {
 	bool is_playback = (stream == &dev->playback);
+	unsigned int buf_size;
 	int i;
 
-	for (i = 0; i < SL3_NUM_URBS; i++) {
+	stream->urbs = kcalloc(dev->urb_count, sizeof(*stream->urbs),
+			       GFP_KERNEL);
+	if (!stream->urbs)
+		return -ENOMEM;
+
+	stream->num_urbs = dev->urb_count;
+	stream->num_packets = dev->urb_packets;
+	stream->pipe = pipe;
+	buf_size = sl3_urb_buffer_size(stream);
+
+	for (i = 0; i < stream->num_urbs; i++) {
 		struct sl3_urb_ctx *ctx = &stream->urbs[i];
 		struct urb *urb;
 
-		urb = usb_alloc_urb(SL3_ISO_PACKETS, GFP_KERNEL);
+		urb = usb_alloc_urb(stream->num_packets, GFP_KERNEL);
 		if (!urb)
 			goto err_free;
 
-		ctx->buffer = usb_alloc_coherent(dev->udev,
-						 SL3_URB_BUFFER_SIZE,
+		ctx->buffer = usb_alloc_coherent(dev->udev, buf_size,
 						 GFP_KERNEL,
 						 &urb->transfer_dma);
 		if (!ctx->buffer) {
@@ -185,13 +1552,14 @@ int sl3_urb_alloc(struct sl3_device *dev, struct sl3_stream *stream, int pipe)
 			goto err_free;
 		}
 
+		ctx->buffer_dma = urb->transfer_dma;
 		urb->dev = dev->udev;
 		urb->pipe = pipe;
 		urb->transfer_buffer = ctx->buffer;
-		urb->transfer_buffer_length = SL3_URB_BUFFER_SIZE;
+		urb->transfer_buffer_length = buf_size;
 		urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP |
 				      URB_ISO_ASAP;
-		urb->number_of_packets = SL3_ISO_PACKETS;
+		urb->number_of_packets = stream->num_packets;
 		urb->interval = 1;
 		urb->context = ctx;
 		urb->complete = is_playback ? sl3_playback_complete
@@ -200,6 +1568,8 @@ int sl3_urb_alloc(struct sl3_device *dev, struct sl3_stream *stream, int pipe)
 		ctx->urb = urb;
 		ctx->dev = dev;
 		ctx->index = i;
+		ctx->start_packet = -1;
+		INIT_LIST_HEAD(&ctx->ready_list);
 	}
 
 	return 0;
@@ -212,54 +1582,181 @@ err_free:
 /* Free all URBs and DMA buffers for a stream. */
 void sl3_urb_free(struct sl3_device *dev, struct sl3_stream *stream)
 {
+	unsigned int buf_size = sl3_urb_buffer_size(stream);
 	int i;
 
-	for (i = 0; i < SL3_NUM_URBS; i++) {
+	if (!stream->urbs)
+		return;
+
+	/* The watchdog queues recover_work, so it goes first */
+	hrtimer_cancel(&stream->watchdog);
+	cancel_delayed_work_sync(&stream->recover_work);
+
+	/* A stopped stream may still have URBs draining */
+	usb_kill_anchored_urbs(&stream->anchor);
+
+	for (i = 0; i < stream->num_urbs; i++) {
 		struct sl3_urb_ctx *ctx = &stream->urbs[i];
 
 		if (!ctx->urb)
 			continue;
 
 		if (ctx->buffer) {
-			usb_free_coherent(dev->udev, SL3_URB_BUFFER_SIZE,
-					  ctx->buffer,
-					  ctx->urb->transfer_dma);
+			usb_free_coherent(dev->udev, buf_size,
+					  ctx->buffer, ctx->buffer_dma);
 			ctx->buffer = NULL;
 		}
 		usb_free_urb(ctx->urb);
 		ctx->urb = NULL;
 	}
+
+	kfree(stream->urbs);
+	stream->urbs = NULL;
+	stream->num_urbs = 0;
+}
+
+/*
+ * Wait for the URBs of a stopped stream that are still completing, and
+ * for any recovery still running on it.  Caller must hold stream_mutex.
+ */
+void sl3_urb_drain(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	if (stream->running || !stream->urbs)
+		return;
+
+	hrtimer_cancel(&stream->watchdog);
+	cancel_delayed_work_sync(&stream->recover_work);
+	sl3_urb_cancel(stream);
+}
+
+/*
+ * Lay out a stopped stream's URBs for its next start: packet sizes and
+ * silence, so that the trigger only has to prime and submit them.
+ */
+static void sl3_urb_layout(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	bool is_playback = (stream == &dev->playback);
+	int i;
+
+	if (is_playback) {
+		dev->sample_accumulator = 0;
+		INIT_LIST_HEAD(&stream->ready_list);
+		stream->zerocopy = dev->zerocopy && stream->substream &&
+				   stream->substream->runtime->dma_addr;
+		stream->ring_inflight = 0;
+		if (stream->lowlatency)
+			stream->max_inflight =
+				sl3_lowlatency_max_inflight(stream);
+	}
+
+	stream->coalesce = sl3_coalesce_urbs(dev, stream);
+
+	for (i = 0; i < stream->num_urbs; i++) {
+		struct sl3_urb_ctx *ctx = &stream->urbs[i];
+
+		ctx->ring_frames = 0;
+		if (is_playback && stream->lowlatency) {
+			/* Filled from the ring buffer as data arrives */
+			ctx->sized = false;
+			list_add_tail(&ctx->ready_list, &stream->ready_list);
+		} else if (is_playback) {
+			sl3_prepare_playback_urb(dev, ctx);
+		} else {
+			sl3_prepare_capture_urb(ctx);
+		}
+	}
+
+	stream->laid_out = true;
 }
 
-/* Prepare and submit all URBs to start audio streaming. */
-int sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream)
+/*
+ * Settle a stopped stream before it is started again: wait for URBs
+ * still draining from the last trigger stop, reallocate them if the
+ * requested queue geometry changed, and lay them out for the start.
+ * Caller must hold stream_mutex.
+ */
+int sl3_urb_prepare(struct sl3_device *dev, struct sl3_stream *stream)
 {
 	bool is_playback = (stream == &dev->playback);
-	int i, err;
+	int err;
 
-	if (dev->disconnected)
-		return -ENODEV;
+	if (stream->running)
+		return 0;
+
+	if (stream->urbs && stream->num_urbs == dev->urb_count &&
+	    stream->num_packets == dev->urb_packets) {
+		sl3_urb_drain(dev, stream);
+		sl3_urb_layout(dev, stream);
+		return 0;
+	}
+
+	sl3_urb_free(dev, stream);
+	err = sl3_urb_alloc(dev, stream, stream->pipe);
+	if (err) {
+		dev_err(&dev->intf->dev, "%s URB realloc failed: %d\n",
+			is_playback ? "playback" : "capture", err);
+		return err;
+	}
+
+	dev_dbg(&dev->intf->dev, "%s URB queue: %u URBs x %u packets\n",
+		is_playback ? "playback" : "capture",
+		stream->num_urbs, stream->num_packets);
+	sl3_urb_layout(dev, stream);
+	return 0;
+}
+
+/*
+ * Prepare and submit all URBs to start streaming a stopped stream.  The
+ * first goes out as soon as possible.  If ring data is to start on a
+ * given microframe, the rest of a playback queue is filled one URB at a
+ * time once the host controller has said where the first one went, so
+ * each URB is filled for the frame it goes out on.
+ */
+static int __sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	bool is_playback = (stream == &dev->playback);
+	unsigned long flags;
+	bool fill;
+	int i, err;
 
 	/* Already running (e.g. implicit capture started by playback) */
 	if (stream->running)
 		return 0;
 
+	if (!stream->urbs)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	bitmap_zero(stream->dead_urbs, SL3_MAX_URBS);
+	stream->reset_pending = 0;
+	fill = is_playback && stream->start_pending && stream->start_ns;
+	if (!is_playback) {
+		dev->rate_started = false;
+		dev->rate_valid = false;
+	}
+	spin_unlock_irqrestore(&stream->lock, flags);
+	sl3_stream_reschedule(stream);
+
+	/* Only follow capture packets that complete from now on */
 	if (is_playback)
-		dev->sample_accumulator = 0;
+		kfifo_reset_out(&dev->feedback_fifo);
 
-	/* Prepare all URBs before submitting to avoid races with completions */
-	for (i = 0; i < SL3_NUM_URBS; i++) {
-		if (is_playback)
-			sl3_prepare_playback_urb(dev, &stream->urbs[i]);
-		else
-			sl3_prepare_capture_urb(&stream->urbs[i]);
+	/* Normally done by .prepare, unless a rate change undid it */
+	if (!stream->laid_out)
+		sl3_urb_layout(dev, stream);
+	stream->laid_out = false;
+
+	if (is_playback && !stream->lowlatency && !fill) {
+		spin_lock_irqsave(&stream->lock, flags);
+		sl3_prime_playback(dev);
+		spin_unlock_irqrestore(&stream->lock, flags);
 	}
 
 	stream->running = true;
 
 	/* Playback requires capture for implicit feedback */
 	if (is_playback && !dev->capture.running) {
-		err = sl3_urb_start(dev, &dev->capture);
+		err = __sl3_urb_start(dev, &dev->capture);
 		if (err) {
 			dev_err(&dev->intf->dev,
 				"implicit capture start failed: %d\n", err);
@@ -268,43 +1765,221 @@ int sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream)
 		}
 	}
 
-	for (i = 0; i < SL3_NUM_URBS; i++) {
-		err = usb_submit_urb(stream->urbs[i].urb, GFP_ATOMIC);
+	if (is_playback && stream->lowlatency) {
+		/* Periods crossed here are reported by the next completion */
+		spin_lock_irqsave(&stream->lock, flags);
+		__sl3_queue_pending_playback(dev);
+		spin_unlock_irqrestore(&stream->lock, flags);
+		if (!atomic_read(&stream->urbs_inflight)) {
+			stream->running = false;
+			return -EIO;
+		}
+		goto started;
+	}
+
+	for (i = 0; i < stream->num_urbs; i++) {
+		if (fill && i) {
+			spin_lock_irqsave(&stream->lock, flags);
+			sl3_copy_playback_urb(dev, &stream->urbs[i]);
+			spin_unlock_irqrestore(&stream->lock, flags);
+		}
+
+		err = sl3_submit_urb(stream, stream->urbs[i].urb);
 		if (err) {
 			dev_err(&dev->intf->dev,
 				"%s URB[%d] submit failed: %d\n",
 				is_playback ? "playback" : "capture",
 				i, err);
+			/* Cancel those already queued; .sync_stop waits */
 			stream->running = false;
+			sl3_urb_unlink_all(stream);
 			return err;
 		}
 	}
 
+started:
+	sl3_watchdog_start(stream);
 	dev_dbg(&dev->intf->dev, "%s streaming started (%u Hz)\n",
 		is_playback ? "playback" : "capture", dev->current_rate);
 	return 0;
 }
 
-/* Kill all in-flight URBs and stop audio streaming. */
+/*
+ * Reset the per-run PCM state of a stream and let its URBs move ring
+ * buffer data, from the packet on microframe @uframe (estimated time
+ * @ns) or, if @ns is 0, from the next URB on.  Called under
+ * stream->lock.
+ */
+static void sl3_stream_activate(struct sl3_stream *stream,
+				unsigned int uframe, s64 ns)
+{
+	stream->start_frame = uframe;
+	stream->start_ns = ns;
+	stream->start_pending = true;
+	stream->first_valid = false;
+	stream->ptr_step = 0;
+	stream->link_uframes = 0;
+	stream->link_valid = false;
+	stream->copy_ns = 0;
+	stream->copy_max_ns = 0;
+	stream->copy_urbs = 0;
+	stream->in_xrun = false;
+	stream->xrun_pending = false;
+	stream->active = true;
+}
+
+/* Stop moving ring buffer data; the URBs may carry on streaming */
+static void sl3_stream_deactivate(struct sl3_stream *stream)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	stream->active = false;
+	spin_unlock_irqrestore(&stream->lock, flags);
+}
+
+/*
+ * Start moving audio for a PCM trigger START of @stream and, for linked
+ * substreams, @linked (or NULL).  Stopped streams are primed and
+ * submitted; one kept streaming by keepalive, running as implicit
+ * capture or started by this trigger for playback, carries on.  Ring
+ * data then starts at once for a single stream, and for linked ones or
+ * an armed time on one common microframe, at the time armed on either
+ * stream if there is one: queues run silence up to it.
+ */
+int sl3_urb_start(struct sl3_device *dev, struct sl3_stream *stream,
+		  struct sl3_stream *linked)
+{
+	struct sl3_stream *streams[] = { stream, linked };
+	unsigned long flags;
+	unsigned int uframe;
+	s64 armed = 0, ns;
+	int i, err = 0;
+
+	if (dev->disconnected)
+		return -ENODEV;
+
+	if (!stream->urbs || (linked && !linked->urbs))
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(streams) && streams[i]; i++) {
+		struct sl3_stream *s = streams[i];
+
+		spin_lock_irqsave(&s->lock, flags);
+		if (!armed)
+			armed = s->start_at_ns;
+		s->start_at_ns = 0;
+		spin_unlock_irqrestore(&s->lock, flags);
+	}
+
+	uframe = 0;
+	ns = 0;
+	if (armed || linked) {
+		ns = sl3_urb_start_frame(dev, armed, &uframe);
+		if (ns < 0)
+			return ns;
+	}
+	if (ns && dev->playback.running &&
+	    (stream == &dev->playback || linked == &dev->playback))
+		sl3_urb_start_after_queue(&dev->playback, &uframe, &ns);
+
+	for (i = 0; i < ARRAY_SIZE(streams) && streams[i]; i++) {
+		struct sl3_stream *s = streams[i];
+
+		spin_lock_irqsave(&s->lock, flags);
+		sl3_stream_activate(s, uframe, ns);
+		s->start_req_ns = armed;
+		spin_unlock_irqrestore(&s->lock, flags);
+
+		/* Implicit capture started by playback just carries on */
+		if (!s->running)
+			err = __sl3_urb_start(dev, s);
+		else if (s == &dev->playback && !dev->capture.running)
+			err = __sl3_urb_start(dev, &dev->capture);
+		if (err)
+			break;
+	}
+
+	if (err) {
+		sl3_urb_stop_async(dev, stream);
+		if (linked)
+			sl3_urb_stop_async(dev, linked);
+	}
+	return err;
+}
+
+/**
+ * sl3_urb_keepalive - whether a stream keeps streaming when its PCM stops
+ * @dev: device
+ * @stream: stream
+ *
+ * Low-latency and zero-copy playback queue URBs straight from the ring
+ * buffer, so they always stop with the PCM.
+ */
+bool sl3_urb_keepalive(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	if (!READ_ONCE(dev->keepalive))
+		return false;
+
+	return stream != &dev->playback ||
+	       (!stream->lowlatency && !stream->zerocopy);
+}
+
+/*
+ * Stop audio streaming from the PCM trigger: stop moving ring data and,
+ * unless keepalive keeps the endpoint streaming, stop resubmission and
+ * start cancelling the queue without waiting.  .sync_stop
+ * (sl3_urb_drain) waits for the URBs later, outside atomic context.
+ * Capture keeps running for playback's implicit feedback.
+ */
+void sl3_urb_stop_async(struct sl3_device *dev, struct sl3_stream *stream)
+{
+	bool is_playback = (stream == &dev->playback);
+
+	/* No completion touches the ring buffer once this returns */
+	sl3_stream_deactivate(stream);
+
+	if (sl3_urb_keepalive(dev, stream) ||
+	    (!is_playback && dev->playback.running))
+		return;
+
+	stream->running = false;
+	if (stream->urbs)
+		sl3_urb_unlink_all(stream);
+
+	/* Stop implicit capture if playback no longer needs it */
+	if (is_playback && dev->capture.running && !dev->capture.active)
+		sl3_urb_stop_async(dev, &dev->capture);
+}
+
+/*
+ * Cancel all in-flight URBs, stop audio streaming and wait for it.
+ * Capture keeps running for playback's implicit feedback.
+ */
 void sl3_urb_stop(struct sl3_device *dev, struct sl3_stream *stream)
 {
 	bool is_playback = (stream == &dev->playback);
-	int i;
 
-	if (!stream->running)
+	sl3_stream_deactivate(stream);
+
+	if (!stream->running || (!is_playback && dev->playback.running))
 		return;
 
 	stream->running = false;
 
-	for (i = 0; i < SL3_NUM_URBS; i++) {
-		if (stream->urbs[i].urb)
-			usb_kill_urb(stream->urbs[i].urb);
-	}
+	/* A recovery already past its running check must finish first */
+	hrtimer_cancel(&stream->watchdog);
+	cancel_delayed_work_sync(&stream->recover_work);
+
+	/* Start on this queue while implicit capture is stopped */
+	sl3_urb_unlink_all(stream);
 
 	/* Stop implicit capture if playback no longer needs it */
-	if (is_playback && dev->capture.running && !dev->capture.substream)
+	if (is_playback && dev->capture.running && !dev->capture.active)
 		sl3_urb_stop(dev, &dev->capture);
 
+	sl3_urb_cancel(stream);
+
 	dev_dbg(&dev->intf->dev, "%s streaming stopped\n",
 		is_playback ? "playback" : "capture");
 }
@@ -317,10 +1992,15 @@ static void sl3_playback_complete(struct urb *urb)
 	struct sl3_device *dev = ctx->dev;
 	struct sl3_stream *stream = &dev->playback;
 	struct snd_pcm_substream *sub;
+	unsigned int done;
 	unsigned long flags;
 	bool do_elapsed = false;
+	bool xrun;
 	int err;
 
+	atomic_dec(&stream->urbs_inflight);
+	atomic_inc(&stream->completions);
+
 	switch (urb->status) {
 	case 0:
 		ctx->error_retries = 0;
@@ -340,29 +2020,29 @@ static void sl3_playback_complete(struct urb *urb)
 		goto resubmit;
 	case -EPIPE:
 		dev_warn_ratelimited(&dev->intf->dev,
-				     "playback URB[%d] stall, clearing halt\n",
+				     "playback URB[%d] stall, resetting endpoint\n",
 				     ctx->index);
-		usb_clear_halt(dev->udev, urb->pipe);
-		goto resubmit;
+		if (stream->running && !dev->disconnected)
+			sl3_urb_request_reset(stream, SL3_RESET_HALT);
+		return;
 	default:
 		dev_warn_ratelimited(&dev->intf->dev,
 				     "playback URB[%d] error: %d\n",
 				     ctx->index, urb->status);
 		if (++ctx->error_retries >= SL3_URB_MAX_RETRIES) {
-			dev_err(&dev->intf->dev,
-				"playback URB[%d] %d consecutive errors, stopping\n",
-				ctx->index, ctx->error_retries);
-			sub = stream->substream;
-			if (sub) {
-				atomic_inc(&dev->play_underruns);
-				snd_pcm_stop_xrun(sub);
-			}
+			dev_err_ratelimited(&dev->intf->dev,
+					    "playback URB[%d] %d consecutive errors, recovering\n",
+					    ctx->index, ctx->error_retries);
+			if (stream->running && !dev->disconnected)
+				sl3_urb_mark_dead(stream, ctx);
 			return;
 		}
 		goto resubmit;
 	}
 
-	if (!stream->running || dev->disconnected)
+	/* Endpoint being reset: the recovery worker re-primes this URB */
+	if (!stream->running || dev->disconnected ||
+	    READ_ONCE(stream->reset_pending))
 		return;
 
 	atomic64_inc(&dev->play_urbs_completed);
@@ -370,29 +2050,48 @@ static void sl3_playback_complete(struct urb *urb)
 	spin_lock_irqsave(&stream->lock, flags);
 
 	sub = stream->substream;
-	sl3_fill_playback_urb(dev, ctx);
+	done = ctx->frames;
 
-	if (sub && sub->runtime) {
-		while (stream->transfer_done >= sub->runtime->period_size) {
-			stream->transfer_done -= sub->runtime->period_size;
-			do_elapsed = true;
-		}
+	/* Before the URB can be resubmitted and its results overwritten */
+	sl3_stream_check_continuity(dev, stream, urb);
+	sl3_stream_mark_complete(stream, urb, done);
+
+	/* Zero-copy: the ring frames this URB carried have now been sent */
+	sl3_playback_ring_done(stream, ctx);
+
+	if (stream->lowlatency) {
+		/* Park the URB until the application has data for it */
+		list_add_tail(&ctx->ready_list, &stream->ready_list);
+		__sl3_queue_pending_playback(dev);
+	} else {
+		sl3_fill_playback_urb(dev, ctx);
 	}
 
+	do_elapsed = sl3_stream_period_elapsed(stream);
+	xrun = sl3_stream_take_xrun(stream);
+
 	spin_unlock_irqrestore(&stream->lock, flags);
 
 	if (do_elapsed)
 		snd_pcm_period_elapsed(sub);
+	if (xrun)
+		snd_pcm_stop_xrun(sub);
+
+	/* Low-latency URBs are resubmitted from the ready list */
+	if (stream->lowlatency)
+		return;
 
 resubmit:
-	if (stream->running && !dev->disconnected) {
-		err = usb_submit_urb(urb, GFP_ATOMIC);
+	if (stream->running && !dev->disconnected &&
+	    !READ_ONCE(stream->reset_pending)) {
+		err = sl3_submit_urb(stream, urb);
 		if (err) {
-			if (err == -ENODEV || err == -ENOENT)
+			if (err == -ENODEV || err == -ENOENT || err == -EPERM)
 				return;
 			dev_err_ratelimited(&dev->intf->dev,
 					    "playback URB[%d] resubmit: %d\n",
 					    ctx->index, err);
+			sl3_urb_mark_dead(stream, ctx);
 		}
 	}
 }
@@ -403,11 +2102,16 @@ static void sl3_capture_complete(struct urb *urb)
 	struct sl3_device *dev = ctx->dev;
 	struct sl3_stream *stream = &dev->capture;
 	struct snd_pcm_substream *sub;
-	struct snd_pcm_runtime *runtime;
-	unsigned int total_samples = 0;
+	unsigned int total_samples;
 	unsigned long flags;
 	bool do_elapsed = false;
-	int i, err;
+	bool dead = false;
+	bool xrun;
+	u64 link_prev;
+	int err;
+
+	atomic_dec(&stream->urbs_inflight);
+	atomic_inc(&stream->completions);
 
 	switch (urb->status) {
 	case 0:
@@ -425,32 +2129,32 @@ static void sl3_capture_complete(struct urb *urb)
 		dev_warn_ratelimited(&dev->intf->dev,
 				     "capture URB[%d] overflow\n",
 				     ctx->index);
-		goto resubmit;
+		sl3_capture_urb_lost(urb);
+		break;
 	case -EPIPE:
 		dev_warn_ratelimited(&dev->intf->dev,
-				     "capture URB[%d] stall, clearing halt\n",
+				     "capture URB[%d] stall, resetting endpoint\n",
 				     ctx->index);
-		usb_clear_halt(dev->udev, urb->pipe);
-		goto resubmit;
+		if (stream->running && !dev->disconnected)
+			sl3_urb_request_reset(stream, SL3_RESET_HALT);
+		return;
 	default:
 		dev_warn_ratelimited(&dev->intf->dev,
 				     "capture URB[%d] error: %d\n",
 				     ctx->index, urb->status);
 		if (++ctx->error_retries >= SL3_URB_MAX_RETRIES) {
-			dev_err(&dev->intf->dev,
-				"capture URB[%d] %d consecutive errors, stopping\n",
-				ctx->index, ctx->error_retries);
-			sub = stream->substream;
-			if (sub) {
-				atomic_inc(&dev->cap_overruns);
-				snd_pcm_stop_xrun(sub);
-			}
-			return;
+			dev_err_ratelimited(&dev->intf->dev,
+					    "capture URB[%d] %d consecutive errors, recovering\n",
+					    ctx->index, ctx->error_retries);
+			dead = true;
 		}
-		goto resubmit;
+		sl3_capture_urb_lost(urb);
+		break;
 	}
 
-	if (!stream->running || dev->disconnected)
+	/* Endpoint being reset: the recovery worker re-primes this URB */
+	if (!stream->running || dev->disconnected ||
+	    READ_ONCE(stream->reset_pending))
 		return;
 
 	atomic64_inc(&dev->cap_urbs_completed);
@@ -458,70 +2162,39 @@ static void sl3_capture_complete(struct urb *urb)
 	spin_lock_irqsave(&stream->lock, flags);
 
 	sub = stream->substream;
-	runtime = sub ? sub->runtime : NULL;
-
-	for (i = 0; i < SL3_ISO_PACKETS; i++) {
-		unsigned int actual = urb->iso_frame_desc[i].actual_length;
-		unsigned int samples = actual / SL3_BYTES_PER_FRAME;
-		unsigned int bytes = samples * SL3_BYTES_PER_FRAME;
-		unsigned int buf_size, hwptr, hwptr_bytes, buf_bytes, pkt_off;
-
-		total_samples += samples;
-
-		if (!runtime || !runtime->dma_area || !bytes)
-			continue;
+	total_samples = sl3_copy_capture_urb(dev, ctx);
 
-		/* Copy packet data into ring buffer, handling wraparound */
-		buf_size = runtime->buffer_size;
-		hwptr = stream->hwptr % buf_size;
-		hwptr_bytes = hwptr * SL3_BYTES_PER_FRAME;
-		buf_bytes = snd_pcm_lib_buffer_bytes(sub);
-		pkt_off = urb->iso_frame_desc[i].offset;
-
-		if (hwptr_bytes + bytes <= buf_bytes) {
-			memcpy(runtime->dma_area + hwptr_bytes,
-			       ctx->buffer + pkt_off, bytes);
-		} else {
-			unsigned int c1 = buf_bytes - hwptr_bytes;
-
-			memcpy(runtime->dma_area + hwptr_bytes,
-			       ctx->buffer + pkt_off, c1);
-			memcpy(runtime->dma_area,
-			       ctx->buffer + pkt_off + c1,
-			       bytes - c1);
-		}
-		stream->hwptr += samples;
-		stream->transfer_done += samples;
-	}
-
-	if (sub && runtime) {
-		while (stream->transfer_done >= runtime->period_size) {
-			stream->transfer_done -= runtime->period_size;
-			do_elapsed = true;
-		}
-	}
+	link_prev = stream->link_uframes;
+	sl3_stream_check_continuity(dev, stream, urb);
+	sl3_stream_mark_complete(stream, urb, total_samples);
+	sl3_rate_update(dev, total_samples, stream->link_uframes - link_prev);
+	do_elapsed = sl3_stream_period_elapsed(stream);
+	xrun = sl3_stream_take_xrun(stream);
 
 	spin_unlock_irqrestore(&stream->lock, flags);
 
-	/* Update implicit feedback for the playback side */
-	spin_lock_irqsave(&dev->feedback_lock, flags);
-	dev->feedback_samples = total_samples;
-	spin_unlock_irqrestore(&dev->feedback_lock, flags);
-
 	if (do_elapsed)
 		snd_pcm_period_elapsed(sub);
+	if (xrun)
+		snd_pcm_stop_xrun(sub);
+
+	if (dead) {
+		sl3_urb_mark_dead(stream, ctx);
+		return;
+	}
 
-resubmit:
 	/* Prepare for next receive and resubmit */
-	if (stream->running && !dev->disconnected) {
+	if (stream->running && !dev->disconnected &&
+	    !READ_ONCE(stream->reset_pending)) {
 		sl3_prepare_capture_urb(ctx);
-		err = usb_submit_urb(urb, GFP_ATOMIC);
+		err = sl3_submit_urb(stream, urb);
 		if (err) {
-			if (err == -ENODEV || err == -ENOENT)
+			if (err == -ENODEV || err == -ENOENT || err == -EPERM)
 				return;
 			dev_err_ratelimited(&dev->intf->dev,
 					    "capture URB[%d] resubmit: %d\n",
 					    ctx->index, err);
+			sl3_urb_mark_dead(stream, ctx);
 		}
 	}
 }
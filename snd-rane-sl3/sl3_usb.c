@@ -15,6 +15,46 @@ module_param(default_sample_rate, int, 0444);
 MODULE_PARM_DESC(default_sample_rate,
 		 "Default sample rate (44100 or 48000, default 48000)");
 
+static int num_urbs = SL3_NUM_URBS;
+module_param(num_urbs, int, 0444);
+MODULE_PARM_DESC(num_urbs,
+		 "Isochronous URBs in flight per stream (2-64, default 16)");
+
+static int urb_packets = SL3_ISO_PACKETS;
+module_param(urb_packets, int, 0444);
+MODULE_PARM_DESC(urb_packets,
+		 "ISO packets (125 us microframes) per URB (1-64, default 8)");
+
+static bool lowlatency;
+module_param(lowlatency, bool, 0444);
+MODULE_PARM_DESC(lowlatency,
+		 "Low-latency playback: copy audio as it is written (default off)");
+
+static bool coalesce;
+module_param(coalesce, bool, 0444);
+MODULE_PARM_DESC(coalesce,
+		 "Coalesce URB completion interrupts to about one per period (default off)");
+
+static bool zerocopy;
+module_param(zerocopy, bool, 0444);
+MODULE_PARM_DESC(zerocopy,
+		 "Zero-copy playback: send straight from the PCM buffer (default off)");
+
+static bool mirror;
+module_param(mirror, bool, 0444);
+MODULE_PARM_DESC(mirror,
+		 "Map PCM buffers twice so copies never wrap (default off)");
+
+static int conceal;
+module_param(conceal, int, 0444);
+MODULE_PARM_DESC(conceal,
+		 "Capture packet concealment: 0=off, 1=silence, 2=repeat last frame (default 0)");
+
+static int keepalive;
+module_param(keepalive, int, 0444);
+MODULE_PARM_DESC(keepalive,
+		 "Keep endpoints streaming silence this many seconds after the last close (default 0 = off)");
+
 static struct usb_driver sl3_usb_driver;
 
 static const struct usb_device_id sl3_id_table[] = {
@@ -53,9 +93,17 @@ static int sl3_probe(struct usb_interface *intf,
 	/* Initialize synchronization primitives */
 	mutex_init(&dev->hid_mutex);
 	mutex_init(&dev->stream_mutex);
-	spin_lock_init(&dev->feedback_lock);
+	INIT_KFIFO(dev->feedback_fifo);
 	spin_lock_init(&dev->playback.lock);
 	spin_lock_init(&dev->capture.lock);
+	spin_lock_init(&dev->playback.sched_lock);
+	spin_lock_init(&dev->capture.sched_lock);
+	INIT_LIST_HEAD(&dev->playback.ready_list);
+	atomic_set(&dev->playback.urbs_inflight, 0);
+	atomic_set(&dev->capture.urbs_inflight, 0);
+	dev->playback.coalesce = 1;
+	dev->capture.coalesce = 1;
+	sl3_urb_init(dev);
 	init_completion(&dev->hid_response_complete);
 	atomic64_set(&dev->play_urbs_completed, 0);
 	atomic64_set(&dev->cap_urbs_completed, 0);
@@ -128,6 +176,15 @@ static int sl3_probe(struct usb_interface *intf,
 	dev->routing[0] = SL3_ROUTE_USB;
 	dev->routing[1] = SL3_ROUTE_USB;
 	dev->routing[2] = SL3_ROUTE_USB;
+	dev->urb_count = clamp(num_urbs, SL3_MIN_URBS, SL3_MAX_URBS);
+	dev->urb_packets = clamp(urb_packets, SL3_MIN_ISO_PACKETS,
+				 SL3_MAX_ISO_PACKETS);
+	dev->lowlatency = lowlatency;
+	dev->coalesce = coalesce;
+	dev->zerocopy = zerocopy;
+	dev->mirror = mirror;
+	dev->conceal = clamp(conceal, SL3_CONCEAL_OFF, SL3_CONCEAL_REPEAT);
+	dev->keepalive = clamp(keepalive, 0, SL3_MAX_KEEPALIVE);
 
 	usb_set_intfdata(intf, dev);
 
@@ -169,6 +226,13 @@ static int sl3_probe(struct usb_interface *intf,
 		goto err_card_free;
 	}
 
+	/* Scheduled start interface */
+	err = sl3_hwdep_init(dev);
+	if (err) {
+		dev_err(&intf->dev, "hwdep init failed: %d\n", err);
+		goto err_card_free;
+	}
+
 	/* Create proc filesystem entries */
 	sl3_proc_init(dev);
 
@@ -241,6 +305,7 @@ static void sl3_disconnect(struct usb_interface *intf)
 		snd_card_disconnect(dev->card);
 
 	/* Stop and free audio URBs */
+	cancel_delayed_work_sync(&dev->keepalive_work);
 	sl3_urb_stop(dev, &dev->playback);
 	sl3_urb_stop(dev, &dev->capture);
 	sl3_urb_free(dev, &dev->playback);
@@ -284,6 +349,7 @@ static struct usb_driver sl3_usb_driver = {
 	.id_table	= sl3_id_table,
 	.probe		= sl3_probe,
 	.disconnect	= sl3_disconnect,
+	.dev_groups	= sl3_attr_groups,
 };
 
 module_usb_driver(sl3_usb_driver);